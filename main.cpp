@@ -1,279 +1,5619 @@
+#ifdef _WIN32
+#define NOMINMAX
 #include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#include <signal.h>
+#if defined(__GLIBC__) || defined(__APPLE__)
+#include <execinfo.h>
+#endif
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#endif
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 #include <iostream>
-#include <unordered_map>
+#include <string>
 #include <vector>
 #include <ctime>
 #include <cassert>
+#include <mutex>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <chrono>
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <memory_resource>
+#include <thread>
+#include <condition_variable>
+#include <unordered_map>
+#include <cmath>
 
-// BlockHeader structure to represent metadata for each block
-struct BlockHeader {
-    size_t size;
-    bool is_free;
-    bool is_first;
-    bool is_last;
+// Page provider: the only code that talks to the OS about memory. Address space is reserved first and
+// committed page by page; VirtualAlloc/VirtualFree on Windows, mmap/mprotect/madvise elsewhere.
+// Reservations can be placed on a NUMA node: VirtualAllocExNuma on Windows, mbind on Linux.
+
+// Function to get the OS page size
+size_t os_page_size() {
+    static const size_t page_size = [] {
+#ifdef _WIN32
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        return static_cast<size_t>(info.dwPageSize);
+#else
+        return static_cast<size_t>(sysconf(_SC_PAGESIZE));
+#endif
+    }();
+    return page_size;
+}
+
+// Function to get the large page size the process may use, or 0 if it may not; on Windows the right to
+// lock pages in memory is enabled on first use if the account has it, elsewhere the huge page size
+// of the default hugetlb pool is used
+size_t os_large_page_size() {
+    static const size_t size = [] {
+#ifdef _WIN32
+        HANDLE token;
+        if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token)) {
+            return size_t(0);
+        }
+        TOKEN_PRIVILEGES privileges = {};
+        privileges.PrivilegeCount = 1;
+        privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+        bool enabled = LookupPrivilegeValue(nullptr, SE_LOCK_MEMORY_NAME, &privileges.Privileges[0].Luid) &&
+                       AdjustTokenPrivileges(token, FALSE, &privileges, 0, nullptr, nullptr) &&
+                       GetLastError() == ERROR_SUCCESS;
+        CloseHandle(token);
+        return enabled ? static_cast<size_t>(GetLargePageMinimum()) : size_t(0);
+#elif defined(MAP_HUGETLB)
+        size_t huge_page = 0;
+        if (FILE* meminfo = fopen("/proc/meminfo", "r")) {
+            char line[128];
+            unsigned long kib;
+            while (fgets(line, sizeof(line), meminfo)) {
+                if (sscanf(line, "Hugepagesize: %lu kB", &kib) == 1) {
+                    huge_page = static_cast<size_t>(kib) << 10;
+                    break;
+                }
+            }
+            fclose(meminfo);
+        }
+        return huge_page;
+#else
+        return size_t(0);
+#endif
+    }();
+    return size;
+}
+
+// NUMA nodes are numbered below this limit (a node mask fits in one word); NODE_ANY leaves placement to the OS
+const int NODE_LIMIT = 32;
+const int NODE_ANY = -1;
+
+// Function to get the number of NUMA nodes memory can be placed on (1 where the OS has no notion of them)
+int os_node_count() {
+    static const int count = [] {
+#ifdef _WIN32
+        ULONG highest = 0;
+        return GetNumaHighestNodeNumber(&highest) ? std::min(static_cast<int>(highest) + 1, NODE_LIMIT) : 1;
+#elif defined(__linux__)
+        // the file holds a range such as "0-1", or a single "0"
+        int first = 0;
+        int last = 0;
+        if (FILE* possible = fopen("/sys/devices/system/node/possible", "r")) {
+            if (fscanf(possible, "%d-%d", &first, &last) < 2) {
+                last = first;
+            }
+            fclose(possible);
+        }
+        return std::min(std::max(last, 0) + 1, NODE_LIMIT);
+#else
+        return 1;
+#endif
+    }();
+    return count;
+}
+
+// Function to get the NUMA node the calling thread is running on
+int os_current_node() {
+#ifdef _WIN32
+    PROCESSOR_NUMBER processor;
+    GetCurrentProcessorNumberEx(&processor);
+    USHORT node = 0;
+    return GetNumaProcessorNodeEx(&processor, &node) ? std::min<int>(node, NODE_LIMIT - 1) : 0;
+#elif defined(__linux__) && defined(SYS_getcpu)
+    unsigned cpu = 0;
+    unsigned node = 0;
+    return syscall(SYS_getcpu, &cpu, &node, nullptr) == 0 ? std::min<int>(node, NODE_LIMIT - 1) : 0;
+#else
+    return 0;
+#endif
+}
+
+// Function to have the pages of a POSIX reservation come from a NUMA node where the OS supports it; the
+// node is only preferred, so an exhausted node falls back to the others instead of failing the commit
+void os_bind_node(void* addr, size_t size, int node) {
+#if defined(__linux__) && defined(SYS_mbind)
+    const int MPOL_PREFERRED_MODE = 1;
+    unsigned long mask = 1UL << node;
+    syscall(SYS_mbind, addr, size, MPOL_PREFERRED_MODE, &mask, sizeof(mask) * 8 + 1, 0);
+#else
+    (void)addr;
+    (void)size;
+    (void)node;
+#endif
+}
+
+// Every reservation starts on, and spans whole units of, this boundary (the Windows allocation
+// granularity), so no two reservations ever share one
+const size_t OS_RESERVE_ALIGNMENT = 64 << 10;
+
+// Function to round a reservation size up to whole reservation units
+size_t os_reserve_size(size_t size) {
+    return (size + OS_RESERVE_ALIGNMENT - 1) & ~(OS_RESERVE_ALIGNMENT - 1);
+}
+
+// Function to reserve address space without backing it with memory, on the given NUMA node if not NODE_ANY
+void* os_reserve(size_t size, int node = NODE_ANY) {
+#ifdef _WIN32
+    if (node != NODE_ANY && os_node_count() > 1) {
+        return VirtualAllocExNuma(GetCurrentProcess(), nullptr, size, MEM_RESERVE, PAGE_READWRITE, node);
+    }
+    return VirtualAlloc(nullptr, size, MEM_RESERVE, PAGE_READWRITE);
+#else
+    // mmap only aligns to pages: map the slack needed to align, then unmap what lies outside
+    size = os_reserve_size(size);
+    size_t slack = OS_RESERVE_ALIGNMENT - os_page_size();
+    void* addr = mmap(nullptr, size + slack, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (addr == MAP_FAILED) {
+        return nullptr;
+    }
+    char* begin = static_cast<char*>(addr);
+    char* aligned = reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(begin) + OS_RESERVE_ALIGNMENT - 1) &
+                                            ~(OS_RESERVE_ALIGNMENT - 1));
+    if (aligned > begin) {
+        munmap(begin, aligned - begin);
+    }
+    if (begin + size + slack > aligned + size) {
+        munmap(aligned + size, begin + size + slack - (aligned + size));
+    }
+    if (node != NODE_ANY && os_node_count() > 1) {
+        os_bind_node(aligned, size, node);
+    }
+    return aligned;
+#endif
+}
+
+// Function to reserve and commit a range of whole large pages at once, or nullptr if none can be had
+// (placed on the given NUMA node if not NODE_ANY)
+void* os_reserve_large(size_t size, int node = NODE_ANY) {
+#ifdef _WIN32
+    if (node != NODE_ANY && os_node_count() > 1) {
+        return VirtualAllocExNuma(GetCurrentProcess(), nullptr, size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES,
+                                  PAGE_READWRITE, node);
+    }
+    return VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+#elif defined(MAP_HUGETLB)
+    void* addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (addr == MAP_FAILED) {
+        return nullptr;
+    }
+    // huge pages are only faulted in on first touch, so the node can still be chosen
+    if (node != NODE_ANY && os_node_count() > 1) {
+        os_bind_node(addr, size, node);
+    }
+    return addr;
+#else
+    (void)size;
+    (void)node;
+    return nullptr;
+#endif
+}
+
+// Function to ask for a reserved range to be backed by transparent huge pages where the OS has them
+void os_prefer_huge_pages(void* addr, size_t size) {
+#ifdef MADV_HUGEPAGE
+    madvise(addr, size, MADV_HUGEPAGE);
+#else
+    (void)addr;
+    (void)size;
+#endif
+}
+
+// Function to back reserved pages with memory
+bool os_commit(void* addr, size_t size) {
+#ifdef _WIN32
+    return VirtualAlloc(addr, size, MEM_COMMIT, PAGE_READWRITE) != nullptr;
+#else
+    return mprotect(addr, size, PROT_READ | PROT_WRITE) == 0;
+#endif
+}
+
+// Function to give the memory behind committed pages back to the OS, keeping the range reserved
+// (POSIX pages stay accessible and read back as zeros, which saves splitting the mapping)
+void os_decommit(void* addr, size_t size) {
+#ifdef _WIN32
+    VirtualFree(addr, size, MEM_DECOMMIT);
+#else
+    madvise(addr, size, MADV_DONTNEED);
+#endif
+}
+
+// Function to give committed pages back to the OS and make any later access to them fault, until
+// they are committed again
+void os_protect(void* addr, size_t size) {
+#ifdef _WIN32
+    VirtualFree(addr, size, MEM_DECOMMIT);
+#else
+    madvise(addr, size, MADV_DONTNEED);
+    mprotect(addr, size, PROT_NONE);
+#endif
+}
+
+// Function to return a whole reservation of the given size to the OS
+void os_release(void* addr, size_t size) {
+#ifdef _WIN32
+    (void)size;
+    VirtualFree(addr, 0, MEM_RELEASE);
+#else
+    munmap(addr, os_reserve_size(size));
+#endif
+}
+
+struct Arena;
+struct Heap;
+struct Slab;
+
+// Default alignment of every returned pointer: at least 16 bytes so SSE loads and 16-byte atomics work
+constexpr size_t ALIGNMENT = alignof(std::max_align_t) > 16 ? alignof(std::max_align_t) : 16;
+
+// BlockHeader structure to represent metadata for each block (padded so payloads stay aligned)
+// The flags share a word with the size. By default the header is 16 bytes: sizes take 30 bits and the
+// owning arena is found through an offset; define BLOCK_HEADER_WIDE for a 32-byte header with
+// full-width sizes and a direct arena pointer. The boundary tag keeps a word of its own either way,
+// since the owner rewrites it while other threads may be reading a busy block's flags.
+#ifdef BLOCK_HEADER_WIDE
+struct alignas(ALIGNMENT) BlockHeader {
+    uint64_t size : 60;
+    uint64_t is_free : 1;
+    uint64_t is_first : 1;
+    uint64_t is_last : 1;
+    uint64_t is_large : 1;  // sole block of a dedicated OS mapping, not part of any arena
+    size_t prev_size;       // boundary tag: payload size of the physically previous block
+    Arena* arena;           // owning arena, and through it the owning heap
+    uint32_t magic;         // cookie derived from the header address, validates pointers passed back in
+};
+
+// Largest payload a block inside an arena can have
+const size_t MAX_BLOCK_SIZE = ~size_t(0) >> 4;
+#else
+struct alignas(ALIGNMENT) BlockHeader {
+    uint64_t size : 30;
+    uint64_t arena_offset : 30;  // distance back to the owning arena's descriptor, in ALIGNMENT units
+    uint64_t is_free : 1;
+    uint64_t is_first : 1;
+    uint64_t is_last : 1;
+    uint64_t is_large : 1;       // sole block of a dedicated OS mapping, not part of any arena
+    uint32_t prev_size;          // boundary tag: payload size of the physically previous block
+    uint32_t magic;              // cookie derived from the header address, validates pointers passed back in
+};
+
+// Largest payload a block inside an arena can have
+const size_t MAX_BLOCK_SIZE = (size_t(1) << 30) - ALIGNMENT;
+#endif
+
+// FreeLinks structure stored in the payload of a free block to chain it into its size-class list
+struct FreeLinks {
+    BlockHeader* next;
+    BlockHeader* prev;
+};
+
+// FreeEntry structure stored at the start of a busy payload or slab slot that is being handed back,
+// chaining it into a thread cache bin or a heap's remote-free stack
+struct FreeEntry {
+    FreeEntry* next;
+    void* key;  // marks entries sitting in a thread cache
 };
 
-// Arena structure to represent a memory arena
+// Arena structure to represent a memory arena; it sits at the start of its own mapping, ahead of the blocks
+// (the whole arena is reserved up front, but pages are committed only once blocks reach them)
 struct Arena {
-    size_t size;
-    void* base;
+    size_t size;             // bytes of blocks, excluding this descriptor
+    void* base;              // first block
+    size_t reserved;         // bytes of address space behind the arena, this descriptor included
     Arena* next;
+    Arena* prev;
+    Heap* heap;
+    std::atomic<uint64_t>* commit_map;  // one bit per page, set while the page is committed (stored right after the
+                                        // descriptor); atomic since frees from other threads read it
+    size_t committed_bytes;
+    bool is_spare;           // empty and kept around under the retention limits
+    BlockHeader* rover;      // block the next next-fit scan of this arena starts from
+    BlockHeader* compact_cursor;  // block the next mem_compact slice of this arena resumes at, or nullptr
+    bool is_large_pages;     // backed by large pages, which stay committed for the arena's lifetime
+    uint64_t freed_epoch;    // scavenger period in which a block was last freed into the arena
+    int node;                // NUMA node the arena was placed on, or NODE_ANY
+};
+
+// Base value mixed with the header address to form each block's cookie
+const uint32_t BLOCK_MAGIC = 0x5AB1A4E1;
+
+// Two-level segregated free-list index (TLSF-style) over the free blocks of all arenas:
+// the first level splits sizes by power of two, the second splits each power into SL_INDEX_COUNT ranges
+const int SL_INDEX_LOG2 = 2;
+const int SL_INDEX_COUNT = 1 << SL_INDEX_LOG2;
+const int FL_INDEX_COUNT = sizeof(size_t) * 8;
+
+// Slabs serve requests up to SLAB_MAX_SIZE from 64 KiB chunks carved into equal-size slots with no
+// per-slot header; there is one size class per ALIGNMENT step
+const size_t SLAB_SIZE = 64 << 10;
+const size_t SLAB_MAX_SIZE = 256;
+const size_t SLAB_CLASS_COUNT = SLAB_MAX_SIZE / ALIGNMENT;
+const size_t SLAB_MAP_WORDS = SLAB_SIZE / ALIGNMENT / 64;
+
+// Slab structure to represent one chunk of the slab zone; it sits at the start of the chunk, so the
+// slab of any slot is found by masking the slot's address
+struct Slab {
+    Heap* heap;
+    Slab* next;              // in the owning heap's list of slabs with free slots for this class
+    Slab* prev;
+    char* slots;
+    uint32_t slot_size;      // 0 while the chunk is not in use
+    uint32_t slot_count;
+    uint32_t free_count;
+    uint32_t search_word;    // no free slot sits below this bitmap word
+    uint64_t free_map[SLAB_MAP_WORDS];  // bit set while the slot is free
+};
+
+// Heap structure to represent the arenas, slabs and free-list index owned by a single thread; other
+// threads never touch them and hand memory back through the lock-free remote_free stack instead
+struct Heap {
+    Arena* arena_list = nullptr;
+    size_t fl_bitmap = 0;
+    unsigned sl_bitmap[FL_INDEX_COUNT] = {};
+    BlockHeader* free_lists[FL_INDEX_COUNT][SL_INDEX_COUNT] = {};
+    Slab* slabs[SLAB_CLASS_COUNT] = {};
+    std::atomic<FreeEntry*> remote_free{nullptr};
+    std::atomic<FreeEntry*> scavenged_free{nullptr};  // blocks the scavenger has decommitted, to be put back
+    FreeEntry* scavenged_pending = nullptr;  // taken off scavenged_free but not put back yet (owner only)
+    size_t spare_arenas = 0;
+    size_t spare_bytes = 0;
+    Arena* rover = nullptr;  // arena the next next-fit search starts in
+    Arena* compact_rover = nullptr;  // arena the next mem_compact slice resumes in, or nullptr to start a pass
+    size_t free_blocks = 0;  // blocks on the free lists
+    size_t free_bytes = 0;   // and their payload bytes
+    std::atomic<uint64_t> scavenged_epoch{0};  // scavenger period whose work the heap has handed over
+    Arena* scavenge_rover = nullptr;  // arena the hand-over in progress resumes at
+    int scavenge_class = -1;  // free-list class it resumes at, or -1 while none is in progress
+    BlockHeader* scavenge_block = nullptr;  // block of that class it resumes at, nullptr for the list head
+    std::mutex* stand_in_lock = nullptr;  // taken by the scavenger to act for a heap no thread owns
+    int node = NODE_ANY;     // NUMA node new arenas go on; NODE_ANY follows the thread creating them
+    int home_node = NODE_ANY;  // node of the thread that created or last adopted it (guarded by heap_list_mutex)
+    std::atomic<bool> abandoned{false};  // owner thread exited and nobody stands in for it
+    Heap* next = nullptr;
+};
+
+// LargeMapping structure to represent the OS mapping behind a single large allocation;
+// it sits right before the allocation's BlockHeader, whose own size field is left at 0
+struct alignas(ALIGNMENT) LargeMapping {
+    char* base;
+    size_t size;       // usable payload bytes
+    size_t reserved;   // address space kept for growing in place
+    size_t committed;  // bytes from base backed by memory
 };
 
 // Global variables for the memory allocator
-size_t default_arena_size;
-Arena* arena_list = nullptr;
-std::unordered_map<void*, BlockHeader*> block_map;
+std::atomic<size_t> default_arena_size{0};
+std::atomic<size_t> large_alloc_threshold{1 << 20};  // requests of this size or more bypass the arenas
+std::atomic<size_t> decommit_threshold{64 << 10};     // freed spans of at least this size give pages back
+std::atomic<size_t> arena_retain_count{1};            // empty arenas each heap keeps instead of releasing
+std::atomic<size_t> arena_retain_bytes{16 << 20};     // and the most bytes those spare arenas may span
+std::atomic<size_t> large_retain_bytes{4 << 20};      // largest freed large mapping kept, committed, for reuse
+std::atomic<bool> arena_large_pages{false};           // back new arenas with large pages where permitted
+std::atomic<bool> scavenger_running{false};           // decommits and arena releases are left to the scavenger
+std::atomic<uint64_t> scavenge_epoch{0};              // scavenger periods begun so far
+std::atomic<uint64_t> scavenge_decay{8};              // idle periods before the scavenger releases a retained spare arena
 
-// Function to align the size to a 4-byte boundary
-size_t align(size_t size) {
-    return (size + 3) & ~3;
+// Fit strategies the mem_* functions can be switched between at runtime
+enum FitStrategy { FIT_GOOD, FIT_EXACT, FIT_BEST, FIT_NEXT };
+std::atomic<FitStrategy> fit_strategy{FIT_GOOD};
+Heap* heap_list = nullptr;
+Heap* heap_adopt_cursor = nullptr;  // heap adopted last; the next search for an abandoned heap starts after it
+std::mutex heap_list_mutex;
+
+// Address range reserved once for every slab, so a pointer is recognised as a slot with two compares;
+// chunks are taken from the bottom up and released chunks are pooled for reuse
+const size_t SLAB_ZONE_SIZE = sizeof(void*) == 8 ? size_t(1) << 32 : size_t(1) << 26;
+char* const slab_zone = static_cast<char*>(os_reserve(SLAB_ZONE_SIZE));
+const size_t slab_zone_size = slab_zone ? SLAB_ZONE_SIZE : 0;
+std::atomic<size_t> slab_zone_used{0};
+std::mutex slab_pool_mutex;
+Slab* slab_pool = nullptr;
+
+// Statistics: each thread keeps its own counters and is their only writer, so they are kept with
+// relaxed loads and stores instead of read-modify-writes; mem_stats adds every thread's up. Byte,
+// arena and free-block counters are balances that one thread may drive below zero (freeing what
+// another allocated) but which add up correctly.
+
+// Size classes the call counts are kept by: class n counts requests of [2^n, 2^(n+1)) bytes
+const int STATS_CLASS_COUNT = 64;
+
+// ClassStats structure to represent the call counts of one size class
+struct ClassStats {
+    std::atomic<uint64_t> allocs{0};
+    std::atomic<uint64_t> frees{0};
+    std::atomic<uint64_t> reallocs_in_place{0};
+    std::atomic<uint64_t> reallocs_copied{0};
+};
+
+// ThreadStats structure to represent one thread's counters; those of an exited thread are adopted by
+// the next new thread, so nothing counted is lost
+struct ThreadStats {
+    std::atomic<uint64_t> bytes_in_use{0};  // usable bytes of live allocations made through mem_*
+    std::atomic<uint64_t> committed{0};
+    std::atomic<uint64_t> reserved{0};
+    std::atomic<uint64_t> arenas{0};
+    std::atomic<uint64_t> free_blocks{0};   // blocks on heap free lists
+    std::atomic<uint64_t> free_bytes{0};
+    ClassStats classes[STATS_CLASS_COUNT];
+    bool abandoned = false;  // owner thread exited; guarded by stats_list_mutex
+    ThreadStats* next = nullptr;
+};
+
+ThreadStats* stats_list = nullptr;
+std::mutex stats_list_mutex;
+
+// Function to add to one of the calling thread's counters
+void stats_add(std::atomic<uint64_t>& counter, uint64_t delta) {
+    counter.store(counter.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
 }
 
-// Function to create a new memory arena
-Arena* arena_create(size_t size) {
-    size = max(size, default_arena_size);
-    size = align(size);
+// Function to subtract from one of the calling thread's counters
+void stats_sub(std::atomic<uint64_t>& counter, uint64_t delta) {
+    counter.store(counter.load(std::memory_order_relaxed) - delta, std::memory_order_relaxed);
+}
 
-    void* base = VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
-    if (!base) {
-        return nullptr;
+// Function to take over the counters of an exited thread, or create counters for the calling thread
+ThreadStats* stats_acquire() {
+    std::lock_guard<std::mutex> lock(stats_list_mutex);
+    for (ThreadStats* stats = stats_list; stats; stats = stats->next) {
+        if (stats->abandoned) {
+            stats->abandoned = false;
+            return stats;
+        }
     }
 
-    Arena* arena = new Arena{ size, base, arena_list };
-    arena_list = arena;
+    ThreadStats* stats = new ThreadStats();
+    stats->next = stats_list;
+    stats_list = stats;
+    return stats;
+}
 
-    BlockHeader* initial_block = reinterpret_cast<BlockHeader*>(base);
-    initial_block->size = size - sizeof(BlockHeader);
-    initial_block->is_free = true;
-    initial_block->is_first = true;
-    initial_block->is_last = true;
+// Function to give up a thread's counters when it exits, for the next new thread to adopt
+void stats_abandon(ThreadStats* stats) {
+    std::lock_guard<std::mutex> lock(stats_list_mutex);
+    stats->abandoned = true;
+}
 
-    block_map[base] = initial_block;
+// Function to get the calling thread's counters (kept with its thread cache)
+ThreadStats& thread_stats();
 
-    return arena;
+// Largest request the size-class rounding can handle without overflowing
+const size_t MAX_ALLOC_SIZE = ~size_t(0) >> 2;
+
+// Function to align the size to the default alignment boundary
+size_t align(size_t size) {
+    return (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
 }
 
-// Function to split a block if it's larger than the requested size
-void block_split(BlockHeader* block, size_t size) {
-    size = align(size);
-    if (block->size >= size + sizeof(BlockHeader) + 4) {
-        BlockHeader* new_block = reinterpret_cast<BlockHeader*>(
-                reinterpret_cast<char*>(block) + sizeof(BlockHeader) + size);
-        new_block->size = block->size - size - sizeof(BlockHeader);
-        new_block->is_free = true;
-        new_block->is_first = false;
-        new_block->is_last = block->is_last;
+// Smallest payload a block can have: a free block must be able to hold its free-list links
+const size_t MIN_BLOCK_SIZE = align(sizeof(FreeLinks));
 
-        block->size = size;
-        block->is_last = false;
+// Function to find the index of the lowest set bit (value must be non-zero)
+int bit_ffs(uint64_t value) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward64(&index, value);
+    return static_cast<int>(index);
+#else
+    return __builtin_ctzll(value);
+#endif
+}
+
+// Function to find the index of the highest set bit (value must be non-zero)
+int bit_fls(uint64_t value) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanReverse64(&index, value);
+    return static_cast<int>(index);
+#else
+    return 63 - __builtin_clzll(value);
+#endif
+}
+
+// Function to get the size class that a free block of the given size belongs to
+void mapping_insert(size_t size, int& fl, int& sl) {
+    fl = bit_fls(size);
+    sl = static_cast<int>(size >> (fl - SL_INDEX_LOG2)) ^ SL_INDEX_COUNT;
+}
+
+// Function to get the first size class whose blocks are all large enough for the request
+void mapping_search(size_t size, int& fl, int& sl) {
+    size += (size_t(1) << (bit_fls(size) - SL_INDEX_LOG2)) - 1;
+    mapping_insert(size, fl, sl);
+}
+
+// Function to get the free-list links stored in a free block's payload
+FreeLinks* block_links(BlockHeader* block) {
+    return reinterpret_cast<FreeLinks*>(block + 1);
+}
 
-        block_map[new_block] = new_block;
+// Function to get the arena a block belongs to
+Arena* block_arena(const BlockHeader* block) {
+#ifdef BLOCK_HEADER_WIDE
+    return block->arena;
+#else
+    return reinterpret_cast<Arena*>(const_cast<char*>(reinterpret_cast<const char*>(block)) -
+                                    size_t(block->arena_offset) * ALIGNMENT);
+#endif
+}
+
+// Function to record the arena a block belongs to
+void block_set_arena(BlockHeader* block, Arena* arena) {
+#ifdef BLOCK_HEADER_WIDE
+    block->arena = arena;
+#else
+    block->arena_offset = (reinterpret_cast<char*>(block) - reinterpret_cast<char*>(arena)) / ALIGNMENT;
+#endif
+}
+
+// Function to add a free block to the head of its size-class list
+void free_list_insert(Heap* heap, BlockHeader* block) {
+    int fl, sl;
+    mapping_insert(block->size, fl, sl);
+
+    BlockHeader* head = heap->free_lists[fl][sl];
+    block_links(block)->next = head;
+    block_links(block)->prev = nullptr;
+    if (head) {
+        block_links(head)->prev = block;
     }
+    heap->free_lists[fl][sl] = block;
+
+    heap->fl_bitmap |= size_t(1) << fl;
+    heap->sl_bitmap[fl] |= 1u << sl;
+
+    ++heap->free_blocks;
+    heap->free_bytes += block->size;
+    ThreadStats& stats = thread_stats();
+    stats_add(stats.free_blocks, 1);
+    stats_add(stats.free_bytes, block->size);
 }
 
-// Function to coalesce adjacent free blocks
-void block_unite() {
-    for (auto it = block_map.begin(); it != block_map.end();) {
-        BlockHeader* block = it->second;
-        if (block->is_free) {
-            char* base = reinterpret_cast<char*>(block);
-            BlockHeader* next_block = reinterpret_cast<BlockHeader*>(
-                    base + sizeof(BlockHeader) + block->size);
-
-            if (block_map.find(next_block) != block_map.end() && next_block->is_free) {
-                block->size += sizeof(BlockHeader) + next_block->size;
-                block->is_last = next_block->is_last;
-                block_map.erase(next_block);
-                continue;
-            }
+// Function to unlink a free block from its size-class list
+void free_list_remove(Heap* heap, BlockHeader* block) {
+    int fl, sl;
+    mapping_insert(block->size, fl, sl);
+
+    FreeLinks* links = block_links(block);
+    if (heap->scavenge_block == block) {
+        // The hand-over in progress resumes at the next block, or at the next class after the last
+        heap->scavenge_block = links->next;
+        heap->scavenge_class += links->next ? 0 : 1;
+    }
+    if (links->prev) {
+        block_links(links->prev)->next = links->next;
+    } else {
+        heap->free_lists[fl][sl] = links->next;
+    }
+    if (links->next) {
+        block_links(links->next)->prev = links->prev;
+    }
+
+    if (!heap->free_lists[fl][sl]) {
+        heap->sl_bitmap[fl] &= ~(1u << sl);
+        if (!heap->sl_bitmap[fl]) {
+            heap->fl_bitmap &= ~(size_t(1) << fl);
         }
-        ++it;
     }
+
+    --heap->free_blocks;
+    heap->free_bytes -= block->size;
+    ThreadStats& stats = thread_stats();
+    stats_sub(stats.free_blocks, 1);
+    stats_sub(stats.free_bytes, block->size);
 }
 
-// Function to allocate a block of memory from an arena
-void* block_alloc(Arena* arena, size_t size) {
-    size = align(size);
+// Function to find a free block of at least the given size in constant time
+BlockHeader* free_list_find(Heap* heap, size_t size) {
+    int fl, sl;
+    mapping_search(size, fl, sl);
 
-    char* base = static_cast<char*>(arena->base);
-    while (reinterpret_cast<size_t>(base) < reinterpret_cast<size_t>(arena->base) + arena->size) {
-        BlockHeader* block = reinterpret_cast<BlockHeader*>(base);
-        if (block->is_free && block->size >= size) {
-            block_split(block, size);
-            block->is_free = false;
-            return base + sizeof(BlockHeader);
+    unsigned sl_map = heap->sl_bitmap[fl] & (~0u << sl);
+    if (!sl_map) {
+        size_t fl_map = fl + 1 < FL_INDEX_COUNT ? heap->fl_bitmap & (~size_t(0) << (fl + 1)) : 0;
+        if (!fl_map) {
+            return nullptr;
         }
-        base += sizeof(BlockHeader) + block->size;
+        fl = bit_ffs(fl_map);
+        sl_map = heap->sl_bitmap[fl];
     }
-    return nullptr;
+    sl = bit_ffs(sl_map);
+    return heap->free_lists[fl][sl];
 }
 
-// Function to allocate memory
-void* mem_alloc(size_t size) {
-    if (size == 0) {
-        return nullptr;
+// GoodFit structure to represent the default fit policy: the rounded-up TLSF search, constant time
+// and never more than a size class too large
+struct GoodFit {
+    static BlockHeader* find(Heap* heap, size_t size) {
+        return free_list_find(heap, size);
     }
+};
 
-    size = align(size);
+// Most blocks ExactFit and BestFit look at in one size-class list, which keeps their searches constant
+// time on a heap fragmented into long lists (their fit is then only the best among the blocks looked at)
+const size_t FIT_SEARCH_LIMIT = 32;
 
-    for (Arena* arena = arena_list; arena; arena = arena->next) {
-        if (void* ptr = block_alloc(arena, size)) {
-            return ptr;
+// ExactFit structure to represent a fit policy that first walks the request's own size class for a
+// block that fits, splitting less at the cost of a list walk, before falling back to GoodFit; the walk
+// stops after FIT_SEARCH_LIMIT blocks, so a search is O(FIT_SEARCH_LIMIT)
+struct ExactFit {
+    static BlockHeader* find(Heap* heap, size_t size) {
+        int fl, sl;
+        mapping_insert(size, fl, sl);
+        size_t budget = FIT_SEARCH_LIMIT;
+        for (BlockHeader* block = heap->free_lists[fl][sl]; block && budget; block = block_links(block)->next) {
+            if (block->size >= size) {
+                return block;
+            }
+            --budget;
         }
+        return free_list_find(heap, size);
     }
+};
 
-    Arena* new_arena = arena_create(size + sizeof(BlockHeader));
-    if (!new_arena) {
-        return nullptr;
+// BestFit structure to represent a fit policy that returns the smallest free block that fits; the size
+// classes already order the free blocks, so only the request's own class and the first non-empty class
+// above it are walked, each for at most FIT_SEARCH_LIMIT blocks: a search is O(FIT_SEARCH_LIMIT), and
+// exact whenever neither list is longer than that
+struct BestFit {
+    static BlockHeader* find(Heap* heap, size_t size) {
+        int fl, sl;
+        mapping_insert(size, fl, sl);
+        BlockHeader* best = nullptr;
+        size_t budget = FIT_SEARCH_LIMIT;
+        for (BlockHeader* block = heap->free_lists[fl][sl]; block && budget; block = block_links(block)->next) {
+            if (block->size >= size && (!best || block->size < best->size)) {
+                best = block;
+            }
+            --budget;
+        }
+        if (best) {
+            return best;
+        }
+
+        best = free_list_find(heap, size);
+        budget = FIT_SEARCH_LIMIT;
+        for (BlockHeader* block = best; block && budget; block = block_links(block)->next) {
+            if (block->size < best->size) {
+                best = block;
+            }
+            --budget;
+        }
+        return best;
     }
+};
+
+// Radix index: maps every OS_RESERVE_ALIGNMENT chunk of address space the allocator has reserved to
+// the descriptor of the arena, large mapping or slab it belongs to. No two reservations share a chunk,
+// so a lookup is a shift, two loads and a mask. Leaves are reserved on first use and committed by
+// the OS one touched page at a time.
+const int RADIX_ADDRESS_BITS = sizeof(void*) == 8 ? 48 : 32;
+const int RADIX_CHUNK_BITS = 16;
+const int RADIX_LEAF_BITS = 16;
+const int RADIX_ROOT_BITS = RADIX_ADDRESS_BITS - RADIX_CHUNK_BITS - RADIX_LEAF_BITS;
+static_assert(size_t(1) << RADIX_CHUNK_BITS == OS_RESERVE_ALIGNMENT, "a radix chunk is a reservation unit");
+static_assert(SLAB_SIZE % OS_RESERVE_ALIGNMENT == 0, "every slab fills whole radix chunks");
+
+// Kinds of descriptor the radix index holds, kept in the low bits of the descriptor's address
+enum RegionKind : uintptr_t { REGION_NONE, REGION_ARENA, REGION_LARGE, REGION_SLAB };
+const uintptr_t REGION_KIND_MASK = 3;
+
+// RadixLeaf structure to represent the entries of one leaf of the radix index
+struct RadixLeaf {
+    std::atomic<uintptr_t> entries[size_t(1) << RADIX_LEAF_BITS];
+};
+
+std::atomic<RadixLeaf*> radix_root[size_t(1) << RADIX_ROOT_BITS];
 
-    return block_alloc(new_arena, size);
+// Region structure to represent what the radix index knows about an address
+struct Region {
+    RegionKind kind;
+    void* descriptor;  // Arena*, LargeMapping* or Slab*, by kind
+};
+
+// Function to get the radix entry of an address's chunk, creating its leaf if asked to;
+// nullptr if the address is outside the indexed range or the leaf is missing
+std::atomic<uintptr_t>* radix_entry(uintptr_t address, bool create) {
+    uintptr_t chunk = address >> RADIX_CHUNK_BITS;
+    if (chunk >> (RADIX_LEAF_BITS + RADIX_ROOT_BITS)) {
+        return nullptr;
+    }
+    std::atomic<RadixLeaf*>& slot = radix_root[chunk >> RADIX_LEAF_BITS];
+    RadixLeaf* leaf = slot.load(std::memory_order_acquire);
+    if (!leaf && create) {
+        void* memory = os_reserve(sizeof(RadixLeaf));
+        if (!memory || !os_commit(memory, sizeof(RadixLeaf))) {
+            if (memory) {
+                os_release(memory, sizeof(RadixLeaf));
+            }
+            return nullptr;
+        }
+        // Fresh pages read as zero, which is REGION_NONE for every entry
+        RadixLeaf* fresh = static_cast<RadixLeaf*>(memory);
+        if (slot.compare_exchange_strong(leaf, fresh, std::memory_order_acq_rel)) {
+            leaf = fresh;
+        } else {
+            os_release(memory, sizeof(RadixLeaf));
+        }
+    }
+    return leaf ? &leaf->entries[chunk & ((uintptr_t(1) << RADIX_LEAF_BITS) - 1)] : nullptr;
 }
 
-// Function to free memory
-void mem_free(void* ptr) {
-    if (!ptr) {
-        return;
+// Function to record that the reservation [begin, begin + size) belongs to a descriptor
+bool radix_insert(void* begin, size_t size, RegionKind kind, void* descriptor) {
+    uintptr_t first = reinterpret_cast<uintptr_t>(begin);
+    uintptr_t entry = reinterpret_cast<uintptr_t>(descriptor) | kind;
+    for (uintptr_t address = first; address < first + size; address += OS_RESERVE_ALIGNMENT) {
+        std::atomic<uintptr_t>* slot = radix_entry(address, true);
+        if (!slot) {
+            for (uintptr_t undo = first; undo < address; undo += OS_RESERVE_ALIGNMENT) {
+                radix_entry(undo, false)->store(REGION_NONE, std::memory_order_relaxed);
+            }
+            return false;
+        }
+        slot->store(entry, std::memory_order_relaxed);
     }
+    return true;
+}
 
-    auto it = block_map.find(static_cast<char*>(ptr) - sizeof(BlockHeader));
-    if (it == block_map.end()) {
-        return;
+// Function to forget a reservation before it is returned to the OS
+void radix_remove(void* begin, size_t size) {
+    uintptr_t first = reinterpret_cast<uintptr_t>(begin);
+    for (uintptr_t address = first; address < first + size; address += OS_RESERVE_ALIGNMENT) {
+        radix_entry(address, false)->store(REGION_NONE, std::memory_order_relaxed);
     }
+}
 
-    BlockHeader* block = it->second;
-    block->is_free = true;
-    block_unite();
+// Function to find the arena, large mapping or slab an address belongs to, if any
+Region ptr_region(const void* ptr) {
+    std::atomic<uintptr_t>* slot = radix_entry(reinterpret_cast<uintptr_t>(ptr), false);
+    uintptr_t entry = slot ? slot->load(std::memory_order_relaxed) : REGION_NONE;
+    return { static_cast<RegionKind>(entry & REGION_KIND_MASK), reinterpret_cast<void*>(entry & ~REGION_KIND_MASK) };
 }
 
-// Function to reallocate memory
-void* mem_realloc(void* ptr, size_t size) {
-    if (!ptr) {
-        return mem_alloc(size);
-    }
+// Function to compute the cookie a live header at this address must carry
+uint32_t block_cookie(const BlockHeader* block) {
+    uintptr_t address = reinterpret_cast<uintptr_t>(block);
+    return BLOCK_MAGIC ^ static_cast<uint32_t>(address) ^ static_cast<uint32_t>(address >> 16 >> 16);
+}
 
-    size = align(size);
+// Function to align the size to a page boundary
+size_t page_align(size_t size) {
+    return (size + os_page_size() - 1) & ~(os_page_size() - 1);
+}
+
+// Function to check whether an arena page is committed
+bool arena_page_committed(const Arena* arena, size_t page) {
+    return (arena->commit_map[page / 64].load(std::memory_order_relaxed) >> (page % 64)) & 1;
+}
 
-    auto it = block_map.find(static_cast<char*>(ptr) - sizeof(BlockHeader));
-    if (it == block_map.end()) {
+// Function to get the header of a pointer returned by mem_alloc, or nullptr if it isn't in one of our
+// reservations or doesn't carry a valid cookie
+BlockHeader* block_from_ptr(void* ptr) {
+    uintptr_t address = reinterpret_cast<uintptr_t>(ptr);
+    if (address & (ALIGNMENT - 1)) {
         return nullptr;
     }
-
-    BlockHeader* block = it->second;
-    if (block->size >= size) {
-        block_split(block, size);
-        return ptr;
+    // Pointers outside the arenas and large mappings are turned away before anything is read; so is
+    // one whose header would fall into the chunk before a reservation
+    Region region = ptr_region(ptr);
+    if ((region.kind != REGION_ARENA && region.kind != REGION_LARGE) ||
+        ((address & (OS_RESERVE_ALIGNMENT - 1)) < sizeof(BlockHeader) &&
+         ptr_region(static_cast<char*>(ptr) - sizeof(BlockHeader)).descriptor != region.descriptor)) {
+        return nullptr;
     }
-
-    void* new_ptr = mem_alloc(size);
-    if (!new_ptr) {
+    BlockHeader* block = reinterpret_cast<BlockHeader*>(static_cast<char*>(ptr) - sizeof(BlockHeader));
+    // A stray or repeated free can point into a decommitted range of an arena, whose header page must
+    // not be read (it faults on Windows); headers never straddle a page
+    if (region.kind == REGION_ARENA) {
+        const Arena* arena = static_cast<const Arena*>(region.descriptor);
+        size_t page = (reinterpret_cast<char*>(block) - reinterpret_cast<const char*>(arena)) / os_page_size();
+        if (!arena_page_committed(arena, page)) {
+            return nullptr;
+        }
+    }
+    if (block->magic != block_cookie(block)) {
         return nullptr;
     }
+    return block;
+}
 
-    memcpy(new_ptr, ptr, block->size);
-    mem_free(ptr);
-    return new_ptr;
+// Function to commit every page of an arena that overlaps [begin, end), one OS call per missing run
+bool arena_commit(Arena* arena, void* begin, void* end) {
+    char* base = reinterpret_cast<char*>(arena);
+    size_t page_size = os_page_size();
+    size_t page = (static_cast<char*>(begin) - base) / page_size;
+    size_t last = std::min((static_cast<char*>(end) - base + page_size - 1) / page_size,
+                      (static_cast<char*>(arena->base) + arena->size - base + page_size - 1) / page_size);
+
+    while (page < last) {
+        if (arena_page_committed(arena, page)) {
+            ++page;
+            continue;
+        }
+        size_t run_end = page + 1;
+        while (run_end < last && !arena_page_committed(arena, run_end)) {
+            ++run_end;
+        }
+        if (!os_commit(base + page * page_size, (run_end - page) * page_size)) {
+            return false;
+        }
+        arena->committed_bytes += (run_end - page) * page_size;
+        stats_add(thread_stats().committed, (run_end - page) * page_size);
+        for (; page < run_end; ++page) {
+            arena->commit_map[page / 64].fetch_or(uint64_t(1) << (page % 64), std::memory_order_relaxed);
+        }
+    }
+    return true;
 }
 
-// Function to display the memory layout
-void mem_show() {
-    for (Arena* arena = arena_list; arena; arena = arena->next) {
-        std::cout << "Arena (" << arena->size << "b)" << std::endl;
-        char* base = static_cast<char*>(arena->base);
-        while (reinterpret_cast<size_t>(base) < reinterpret_cast<size_t>(arena->base) + arena->size) {
-            BlockHeader* block = reinterpret_cast<BlockHeader*>(base);
-            std::cout << (block->is_free ? "*" : " ") << " Block at " << reinterpret_cast<void*>(base)
-                      << " -> Size: " << block->size
-                      << ", Busy: " << (block->is_free ? "No" : "Yes")
-                      << ", First: " << (block->is_first ? "Yes" : "No")
-                      << ", Last: " << (block->is_last ? "Yes" : "No") << std::endl;
-            base += sizeof(BlockHeader) + block->size;
+// Clears at or above this size stream past the cache, which a clear that large would only flush
+const size_t STREAM_CLEAR_MIN = 256 << 10;
+
+// Function to zero size bytes at begin, with non-temporal stores for large ranges where SSE2 is available
+void memory_clear(void* begin, size_t size) {
+#if defined(__SSE2__) || defined(_M_X64)
+    if (size >= STREAM_CLEAR_MIN) {
+        char* cursor = static_cast<char*>(begin);
+        char* end = cursor + size;
+        char* aligned = reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(cursor) + 15) & ~uintptr_t(15));
+        memset(cursor, 0, aligned - cursor);
+        __m128i zero = _mm_setzero_si128();
+        for (cursor = aligned; end - cursor >= 64; cursor += 64) {
+            _mm_stream_si128(reinterpret_cast<__m128i*>(cursor), zero);
+            _mm_stream_si128(reinterpret_cast<__m128i*>(cursor + 16), zero);
+            _mm_stream_si128(reinterpret_cast<__m128i*>(cursor + 32), zero);
+            _mm_stream_si128(reinterpret_cast<__m128i*>(cursor + 48), zero);
         }
+        _mm_sfence();
+        memset(cursor, 0, end - cursor);
+        return;
     }
-    std::cout << "----------" << std::endl;
+#endif
+    memset(begin, 0, size);
 }
 
-// Function to calculate checksum
-uint32_t checksum(const void* data, size_t size) {
-    const uint8_t* bytes = static_cast<const uint8_t*>(data);
-    uint32_t checksum = 0;
-    for (size_t i = 0; i < size; ++i) {
-        checksum += bytes[i];
+// Function to zero the part of [begin, end) that lies in committed arena pages; pages not committed yet
+// are known zero, since the OS hands them out cleared once committed
+void arena_clear_committed(Arena* arena, char* begin, char* end) {
+    char* base = reinterpret_cast<char*>(arena);
+    size_t page_size = os_page_size();
+    size_t page = (begin - base) / page_size;
+    size_t last = (end - base + page_size - 1) / page_size;
+
+    while (page < last) {
+        if (!arena_page_committed(arena, page)) {
+            ++page;
+            continue;
+        }
+        size_t run_end = page + 1;
+        while (run_end < last && arena_page_committed(arena, run_end)) {
+            ++run_end;
+        }
+        char* run_begin = std::max(begin, base + page * page_size);
+        memory_clear(run_begin, std::min(end, base + run_end * page_size) - run_begin);
+        page = run_end;
     }
-    return checksum;
 }
 
-// Function to fill data with random values
-void random_input(void* data, size_t size) {
-    uint8_t* bytes = static_cast<uint8_t*>(data);
-    for (size_t i = 0; i < size; ++i) {
-        bytes[i] = rand() % 256;
+// Function to decommit every committed arena page that lies entirely inside [begin, end); with defer set
+// the pages are only marked decommitted and the caller sees to the OS call (the scavenger does)
+void arena_decommit(Arena* arena, void* begin, void* end, bool defer = false) {
+    if (arena->is_large_pages) {
+        return;
+    }
+    char* base = reinterpret_cast<char*>(arena);
+    size_t page_size = os_page_size();
+    size_t page = (static_cast<char*>(begin) - base + page_size - 1) / page_size;
+    size_t last = (static_cast<char*>(end) - base) / page_size;
+
+    while (page < last) {
+        if (!arena_page_committed(arena, page)) {
+            ++page;
+            continue;
+        }
+        size_t run_end = page + 1;
+        while (run_end < last && arena_page_committed(arena, run_end)) {
+            ++run_end;
+        }
+        if (!defer) {
+            os_decommit(base + page * page_size, (run_end - page) * page_size);
+        }
+        arena->committed_bytes -= (run_end - page) * page_size;
+        stats_sub(thread_stats().committed, (run_end - page) * page_size);
+        for (; page < run_end; ++page) {
+            arena->commit_map[page / 64].fetch_and(~(uint64_t(1) << (page % 64)), std::memory_order_relaxed);
+        }
     }
 }
 
-// Function to run automatic tests
-void tester(size_t iterations, size_t max_block_size) {
-    default_arena_size = 4096;
-    std::vector<BlockHeader*> arenas;
-    std::vector<void*> allocations;
-    srand(static_cast<unsigned>(time(0)));
+// Function to get the NUMA node memory for the calling thread should go on (NODE_ANY with a single node)
+int thread_node() {
+    return os_node_count() > 1 ? os_current_node() : NODE_ANY;
+}
 
-    for (size_t i = 0; i < iterations; ++i) {
-        std::cout << i + 1 << "/" << iterations << ": \n";
-        int operation = rand() % 3;
-        switch (operation) {
-            case 0: { // mem_alloc
-                size_t size = rand() % max_block_size + 1;
-                std::cout << "mem_alloc(size=" << size << ")" << std::endl;
-                void* ptr = mem_alloc(size);
-                if (ptr) {
-                    random_input(ptr, size);
-                    allocations.push_back(ptr);
-                }
-                break;
-            }
-            case 1: { // mem_free
-                if (!allocations.empty()) {
-                    size_t index = rand() % allocations.size();
-                    void* ptr = allocations[index];
-                    std::cout << "mem_free(ptr=" << ptr << ")" << std::endl;
-                    mem_free(ptr);
-                    allocations.erase(allocations.begin() + index);
-                }
-                break;
-            }
-            case 2: { // mem_realloc
-                if (!allocations.empty()) {
-                    size_t index = rand() % allocations.size();
-                    void* ptr = allocations[index];
-                    size_t new_size = rand() % max_block_size + 1;
-                    std::cout << "mem_realloc(ptr=" << ptr << ", new_size=" << new_size << ")" << std::endl;
-                    void* new_ptr = mem_realloc(ptr, new_size);
-                    if (new_ptr) {
-                        random_input(new_ptr, new_size);
-                        allocations[index] = new_ptr;
-                    }
-                }
-                break;
-            }
+// Function to reserve the mapping for an arena with size usable bytes (the descriptor takes the front
+// of the mapping), committing the descriptor and the first initial bytes after it, on the given node
+// With arena_large_pages set the mapping is rounded up to whole large pages, all committed at once,
+// falling back to ordinary pages when large ones can't be had
+Arena* arena_reserve(Heap* heap, size_t size, size_t initial, int node) {
+    bool want_large_pages = arena_large_pages.load(std::memory_order_relaxed);
+    size_t large_page = want_large_pages ? os_large_page_size() : 0;
+
+    // the commit map is sized with a word to spare for the pages the descriptor and map themselves take
+    size_t map_words = (size + large_page) / os_page_size() / 64 + 2;
+    size_t head = align(sizeof(Arena) + map_words * sizeof(std::atomic<uint64_t>));
+    char* mapping = nullptr;
+    size_t reserved = 0;
+    size_t committed = 0;
+    bool is_large_pages = false;
+    if (large_page) {
+        reserved = (head + size + large_page - 1) & ~(large_page - 1);
+        mapping = static_cast<char*>(os_reserve_large(reserved, node));
+        if (mapping) {
+            size = reserved - head;
+            committed = reserved;
+            is_large_pages = true;
+        }
+    }
+    if (!mapping) {
+        reserved = head + size;
+        mapping = static_cast<char*>(os_reserve(reserved, node));
+        if (!mapping) {
+            return nullptr;
+        }
+        if (want_large_pages) {
+            os_prefer_huge_pages(mapping, reserved);
+        }
+        committed = page_align(head + initial);
+        if (!os_commit(mapping, committed)) {
+            os_release(mapping, reserved);
+            return nullptr;
         }
-        mem_show();
     }
 
-    for (void* ptr : allocations) {
-        mem_free(ptr);
+    std::atomic<uint64_t>* commit_map = reinterpret_cast<std::atomic<uint64_t>*>(mapping + sizeof(Arena));
+    for (size_t word = 0; word < map_words; ++word) {
+        new (&commit_map[word]) std::atomic<uint64_t>(0);
+    }
+    Arena* arena = new (mapping) Arena{ size, mapping + head, reserved, nullptr, nullptr, heap, commit_map, committed, false,
+                                        reinterpret_cast<BlockHeader*>(mapping + head), nullptr, is_large_pages, 0, node };
+    for (size_t page = 0; page < committed / os_page_size(); ++page) {
+        arena->commit_map[page / 64].fetch_or(uint64_t(1) << (page % 64), std::memory_order_relaxed);
+    }
+    if (!radix_insert(mapping, reserved, REGION_ARENA, arena)) {
+        os_release(mapping, reserved);
+        return nullptr;
     }
 
-    std::cout << "Automatic test completed" << std::endl;
+    ThreadStats& stats = thread_stats();
+    stats_add(stats.reserved, reserved);
+    stats_add(stats.committed, committed);
+    stats_add(stats.arenas, 1);
+    return arena;
 }
 
-int main() {
-    default_arena_size = 4096;
+// Function to drop an arena from the statistics and the radix index before its mapping goes
+void arena_unregister(Arena* arena) {
+    ThreadStats& stats = thread_stats();
+    stats_sub(stats.reserved, arena->reserved);
+    stats_sub(stats.committed, arena->committed_bytes);
+    stats_sub(stats.arenas, 1);
+    radix_remove(arena, arena->reserved);
+}
+
+// Function to return an arena's whole mapping to the OS
+void arena_unmap(Arena* arena) {
+    arena_unregister(arena);
+    os_release(arena, arena->reserved);
+}
+
+// Function to create a new memory arena owned by the given heap, on the heap's node or else the node
+// the calling thread runs on
+Arena* arena_create(Heap* heap, size_t size) {
+    const size_t size_limit = MAX_BLOCK_SIZE + sizeof(BlockHeader);
+    if (size > size_limit) {
+        return nullptr;
+    }
+    size = std::min(std::max(size, default_arena_size.load(std::memory_order_relaxed)), size_limit);
+    size = align(size);
+
+    Arena* arena = arena_reserve(heap, size, sizeof(BlockHeader) + MIN_BLOCK_SIZE,
+                                 heap->node != NODE_ANY ? heap->node : thread_node());
+    if (!arena) {
+        return nullptr;
+    }
+    // Rounding up to large pages may leave more than a block can span; the excess goes unused
+    arena->size = std::min(arena->size, size_limit);
+    arena->next = heap->arena_list;
+    if (heap->arena_list) {
+        heap->arena_list->prev = arena;
+    }
+    heap->arena_list = arena;
+
+    BlockHeader* initial_block = static_cast<BlockHeader*>(arena->base);
+    initial_block->size = arena->size - sizeof(BlockHeader);
+    initial_block->prev_size = 0;
+    block_set_arena(initial_block, arena);
+    initial_block->magic = block_cookie(initial_block);
+    initial_block->is_free = true;
+    initial_block->is_first = true;
+    initial_block->is_last = true;
+    initial_block->is_large = false;
+
+    free_list_insert(heap, initial_block);
+
+    return arena;
+}
 
-    /*
-    tester((size_t) 10, (size_t) 1024);
-    */
+// Function to unlink an empty arena from its heap
+void arena_detach(Arena* arena) {
+    Heap* heap = arena->heap;
+    if (heap->rover == arena) {
+        heap->rover = nullptr;
+    }
+    if (heap->compact_rover == arena) {
+        heap->compact_rover = nullptr;
+    }
+    if (heap->scavenge_rover == arena) {
+        heap->scavenge_rover = arena->next;
+    }
+    free_list_remove(heap, static_cast<BlockHeader*>(arena->base));
+    if (arena->prev) {
+        arena->prev->next = arena->next;
+    } else {
+        heap->arena_list = arena->next;
+    }
+    if (arena->next) {
+        arena->next->prev = arena->prev;
+    }
+}
+
+// Function to unlink an empty arena from its heap and return its address range to the OS
+void arena_release(Arena* arena) {
+    arena_detach(arena);
+    arena_unmap(arena);
+}
+
+void scavenge_release_arena(Arena* arena);
+
+// Function to keep an arena that just became empty as a spare, or release it once the heap
+// already holds as many spare arenas or bytes as the retention limits allow; while the scavenger
+// runs the release is left to it
+void arena_retire(Arena* arena) {
+    Heap* heap = arena->heap;
+    if (heap->spare_arenas < arena_retain_count.load(std::memory_order_relaxed) &&
+        heap->spare_bytes + arena->size <= arena_retain_bytes.load(std::memory_order_relaxed)) {
+        arena->is_spare = true;
+        ++heap->spare_arenas;
+        heap->spare_bytes += arena->size;
+        return;
+    }
+    if (scavenger_running.load(std::memory_order_relaxed)) {
+        scavenge_release_arena(arena);
+        return;
+    }
+    arena_release(arena);
+}
+
+// Function to stop counting an arena as spare once a block is handed out from it again
+void arena_reuse(Arena* arena) {
+    if (arena->is_spare) {
+        arena->is_spare = false;
+        --arena->heap->spare_arenas;
+        arena->heap->spare_bytes -= arena->size;
+    }
+}
+
+// Function to get the block that physically follows a block (the block must not be last)
+BlockHeader* block_next(BlockHeader* block) {
+    return reinterpret_cast<BlockHeader*>(reinterpret_cast<char*>(block) + sizeof(BlockHeader) + block->size);
+}
+
+// Function to get the block that physically precedes a block (the block must not be first)
+BlockHeader* block_prev(BlockHeader* block) {
+    return reinterpret_cast<BlockHeader*>(reinterpret_cast<char*>(block) - block->prev_size - sizeof(BlockHeader));
+}
+
+// Function to merge a block with the block that physically follows it
+void block_absorb(BlockHeader* block, BlockHeader* next_block) {
+    block->size += sizeof(BlockHeader) + next_block->size;
+    block->is_last = next_block->is_last;
+    if (!block->is_last) {
+        block_next(block)->prev_size = block->size;
+    }
+    next_block->magic = 0;
+    if (block_arena(block)->rover == next_block) {
+        block_arena(block)->rover = block;
+    }
+    if (block_arena(block)->compact_cursor == next_block) {
+        block_arena(block)->compact_cursor = block;
+    }
+}
+
+// Function to coalesce a free block with its free physical neighbours in constant time
+// (the block must not be on a free list; returns the merged block, also off the lists)
+BlockHeader* block_unite(BlockHeader* block) {
+    Heap* heap = block_arena(block)->heap;
+    if (!block->is_last) {
+        BlockHeader* next_block = block_next(block);
+        if (next_block->is_free) {
+            free_list_remove(heap, next_block);
+            block_absorb(block, next_block);
+        }
+    }
+    if (!block->is_first) {
+        BlockHeader* prev_block = block_prev(block);
+        if (prev_block->is_free) {
+            free_list_remove(heap, prev_block);
+            block_absorb(prev_block, block);
+            block = prev_block;
+        }
+    }
+    return block;
+}
+
+// Function to split a block if it's larger than the requested size
+// (the block itself must not be on a free list; the remainder is merged with a free successor and added to one)
+void block_split(BlockHeader* block, size_t size) {
+    size = align(size);
+    if (block->size >= size + sizeof(BlockHeader) + MIN_BLOCK_SIZE) {
+        BlockHeader* new_block = reinterpret_cast<BlockHeader*>(
+                reinterpret_cast<char*>(block) + sizeof(BlockHeader) + size);
+        // The remainder's header and free-list links must be backed before they are written
+        if (!arena_commit(block_arena(block), new_block, reinterpret_cast<char*>(new_block + 1) + MIN_BLOCK_SIZE)) {
+            return;
+        }
+        new_block->size = block->size - size - sizeof(BlockHeader);
+        new_block->prev_size = size;
+        block_set_arena(new_block, block_arena(block));
+        new_block->magic = block_cookie(new_block);
+        new_block->is_free = true;
+        new_block->is_first = false;
+        new_block->is_last = block->is_last;
+        new_block->is_large = false;
+        if (!new_block->is_last) {
+            block_next(new_block)->prev_size = new_block->size;
+        }
+
+        block->size = size;
+        block->is_last = false;
+
+        free_list_insert(block_arena(block)->heap, block_unite(new_block));
+    }
+}
+
+// Function to grow a busy block in place by absorbing the free block that follows it
+bool block_grow(BlockHeader* block, size_t size) {
+    if (block->is_last) {
+        return false;
+    }
+    BlockHeader* next_block = block_next(block);
+    if (!next_block->is_free || block->size + sizeof(BlockHeader) + next_block->size < size) {
+        return false;
+    }
+    if (!arena_commit(block_arena(block), next_block, reinterpret_cast<char*>(block + 1) + size)) {
+        return false;
+    }
+
+    free_list_remove(block_arena(block)->heap, next_block);
+    block_absorb(block, next_block);
+    block_split(block, size);
+    return true;
+}
+
+// Function to carve a leading gap off a free block so the rest starts at the given offset
+// (the block must not be on a free list; the gap goes back to the free lists, merged with a free
+// predecessor, and the returned remainder is marked busy so it stays off them)
+BlockHeader* block_split_front(BlockHeader* block, size_t gap) {
+    BlockHeader* new_block = reinterpret_cast<BlockHeader*>(reinterpret_cast<char*>(block) + gap);
+    new_block->size = block->size - gap;
+    new_block->prev_size = gap - sizeof(BlockHeader);
+    block_set_arena(new_block, block_arena(block));
+    new_block->magic = block_cookie(new_block);
+    new_block->is_free = false;
+    new_block->is_first = false;
+    new_block->is_last = block->is_last;
+    new_block->is_large = false;
+    if (!new_block->is_last) {
+        block_next(new_block)->prev_size = new_block->size;
+    }
+
+    block->size = gap - sizeof(BlockHeader);
+    block->is_last = false;
+    free_list_insert(block_arena(block)->heap, block_unite(block));
+
+    return new_block;
+}
+
+// Function to check whether a request should get its own mapping instead of an arena block
+bool is_large_size(size_t size) {
+    size_t arena_size = default_arena_size.load(std::memory_order_relaxed);
+    return size >= large_alloc_threshold.load(std::memory_order_relaxed) || size > MAX_BLOCK_SIZE / 2 ||
+           (arena_size && size + sizeof(BlockHeader) > arena_size);
+}
+
+// Function to get the mapping a large block lives in
+LargeMapping* large_mapping(BlockHeader* block) {
+    return reinterpret_cast<LargeMapping*>(block) - 1;
+}
+
+// The most recently freed large mapping small enough to keep, with its pages still committed, so a
+// buffer that keeps outgrowing the arenas isn't faulted in from scratch every time
+std::atomic<LargeMapping*> large_spare{nullptr};
+
+void large_resize_commit(LargeMapping* mapping, size_t committed, size_t offset);
+void large_unmap(LargeMapping* mapping);
+
+// Function to set up the header of a large block at offset into its mapping
+void* large_block_init(char* base, size_t offset) {
+    BlockHeader* block = reinterpret_cast<BlockHeader*>(base + offset) - 1;
+    block->size = 0;
+    block->prev_size = 0;
+    block->magic = block_cookie(block);
+    block->is_free = false;
+    block->is_first = true;
+    block->is_last = true;
+    block->is_large = true;
+    return block + 1;
+}
+
+// Function to allocate a large block in its own page-granular mapping (alignment at most a page), on the
+// given NUMA node or, with NODE_ANY, the node the calling thread runs on; with zero set the block is
+// sure to read as zeroes, so the spare mapping, whose pages hold what was freed, is passed over
+// Twice the committed size is reserved so mem_realloc can usually grow it without copying.
+void* large_alloc(size_t size, size_t alignment, int node = NODE_ANY, bool zero = false) {
+    size_t offset = (sizeof(LargeMapping) + sizeof(BlockHeader) + alignment - 1) & ~(alignment - 1);
+    size_t committed = page_align(offset + size);
+
+    // The spare is only reused at the default alignment, so its descriptor stays where the radix index has it
+    if (!zero && node == NODE_ANY && alignment <= ALIGNMENT && large_spare.load(std::memory_order_relaxed)) {
+        if (LargeMapping* spare = large_spare.exchange(nullptr, std::memory_order_acquire)) {
+            if (committed <= spare->reserved && (committed <= spare->committed ||
+                                                 os_commit(spare->base + spare->committed, committed - spare->committed))) {
+                large_resize_commit(spare, committed, offset);
+                return large_block_init(spare->base, offset);
+            }
+            large_unmap(spare);
+        }
+    }
+    if (node == NODE_ANY) {
+        node = thread_node();
+    }
+
+    size_t reserved = committed * 2;
+    char* base = static_cast<char*>(os_reserve(reserved, node));
+    if (!base) {
+        reserved = committed;
+        base = static_cast<char*>(os_reserve(reserved, node));
+        if (!base) {
+            return nullptr;
+        }
+    }
+    if (!os_commit(base, committed)) {
+        os_release(base, reserved);
+        return nullptr;
+    }
+
+    BlockHeader* block = reinterpret_cast<BlockHeader*>(base + offset) - 1;
+    LargeMapping* mapping = large_mapping(block);
+    mapping->base = base;
+    mapping->size = committed - offset;
+    mapping->reserved = reserved;
+    mapping->committed = committed;
+    if (!radix_insert(base, reserved, REGION_LARGE, mapping)) {
+        os_release(base, reserved);
+        return nullptr;
+    }
+    ThreadStats& stats = thread_stats();
+    stats_add(stats.reserved, reserved);
+    stats_add(stats.committed, committed);
+    return large_block_init(base, offset);
+}
+
+// Function to record a large mapping's new committed size, decommitting what lies past it (pages up to
+// it must already be committed)
+void large_resize_commit(LargeMapping* mapping, size_t committed, size_t offset) {
+    if (committed > mapping->committed) {
+        stats_add(thread_stats().committed, committed - mapping->committed);
+    } else if (committed < mapping->committed) {
+        os_decommit(mapping->base + committed, mapping->committed - committed);
+        stats_sub(thread_stats().committed, mapping->committed - committed);
+    }
+    mapping->committed = committed;
+    mapping->size = committed - offset;
+}
+
+// Function to resize a large block in place by committing or decommitting pages within its reservation
+bool large_resize(BlockHeader* block, size_t size) {
+    LargeMapping* mapping = large_mapping(block);
+    size_t offset = reinterpret_cast<char*>(block + 1) - mapping->base;
+    size_t committed = page_align(offset + size);
+    if (committed > mapping->reserved) {
+        return false;
+    }
+    if (committed > mapping->committed &&
+        !os_commit(mapping->base + mapping->committed, committed - mapping->committed)) {
+        return false;
+    }
+    large_resize_commit(mapping, committed, offset);
+    return true;
+}
+
+// Function to move a large block into a reservation twice its new size without copying: the new pages
+// are committed first, then the committed ones are moved over with mremap; returns the moved payload,
+// or nullptr where there is no mremap or it fails, leaving the block where it was
+void* large_remap(BlockHeader* block, size_t size) {
+#ifdef __linux__
+    LargeMapping* mapping = large_mapping(block);
+    size_t offset = reinterpret_cast<char*>(block + 1) - mapping->base;
+    size_t committed = page_align(offset + size);
+    size_t reserved = committed * 2;
+    char* base = static_cast<char*>(os_reserve(reserved));
+    if (!base) {
+        return nullptr;
+    }
+    LargeMapping* moved = reinterpret_cast<LargeMapping*>(base + (reinterpret_cast<char*>(mapping) - mapping->base));
+    if (!os_commit(base + mapping->committed, committed - mapping->committed) ||
+        !radix_insert(base, reserved, REGION_LARGE, moved)) {
+        os_release(base, reserved);
+        return nullptr;
+    }
+    char* old_base = mapping->base;
+    size_t old_committed = mapping->committed;
+    size_t old_reserved = mapping->reserved;
+    if (mremap(old_base, old_committed, old_committed, MREMAP_MAYMOVE | MREMAP_FIXED, base) == MAP_FAILED) {
+        radix_remove(base, reserved);
+        os_release(base, reserved);
+        return nullptr;
+    }
+    // The pages moved out of the old reservation; what was never committed of it is still mapped
+    munmap(old_base + old_committed, os_reserve_size(old_reserved) - old_committed);
+    radix_remove(old_base, old_reserved);
+
+    ThreadStats& stats = thread_stats();
+    stats_add(stats.reserved, reserved);
+    stats_sub(stats.reserved, old_reserved);
+    stats_add(stats.committed, committed - old_committed);
+    moved->base = base;
+    moved->reserved = reserved;
+    moved->committed = committed;
+    moved->size = committed - offset;
+    return large_block_init(base, offset);
+#else
+    (void)block;
+    (void)size;
+    return nullptr;
+#endif
+}
+
+// Function to grow or shrink a large block without copying its data, in place or by remapping it;
+// returns the payload, which may have moved, or nullptr if the data has to be copied
+void* large_realloc(BlockHeader* block, size_t size) {
+    if (large_resize(block, size)) {
+        return block + 1;
+    }
+    return large_remap(block, size);
+}
+
+// Function to return a large mapping to the OS
+void large_unmap(LargeMapping* mapping) {
+    ThreadStats& stats = thread_stats();
+    stats_sub(stats.reserved, mapping->reserved);
+    stats_sub(stats.committed, mapping->committed);
+    radix_remove(mapping->base, mapping->reserved);
+    os_release(mapping->base, mapping->reserved);
+}
+
+// Function to free a large block: its mapping is kept as the spare if small enough, else returned to the OS
+void large_free(BlockHeader* block) {
+    LargeMapping* mapping = large_mapping(block);
+    block->magic = 0;
+    size_t offset = reinterpret_cast<char*>(block + 1) - mapping->base;
+    if (offset == ((sizeof(LargeMapping) + sizeof(BlockHeader) + ALIGNMENT - 1) & ~(ALIGNMENT - 1)) &&
+        mapping->committed <= large_retain_bytes.load(std::memory_order_relaxed)) {
+        mapping = large_spare.exchange(mapping, std::memory_order_acq_rel);
+        if (!mapping) {
+            return;
+        }
+    }
+    large_unmap(mapping);
+}
+
+// Function to get the slab a pointer would belong to, or nullptr if the pointer is outside the slab zone
+Slab* slab_of(void* ptr) {
+    uintptr_t offset = reinterpret_cast<uintptr_t>(ptr) - reinterpret_cast<uintptr_t>(slab_zone);
+    if (offset >= slab_zone_size) {
+        return nullptr;
+    }
+    return reinterpret_cast<Slab*>(slab_zone + (offset & ~(SLAB_SIZE - 1)));
+}
+
+// Function to check whether a pointer is the start of one of a live slab's slots
+bool slab_owns(const Slab* slab, void* ptr) {
+    char* slot = static_cast<char*>(ptr);
+    return slab->slot_size && slot >= slab->slots &&
+           static_cast<size_t>(slot - slab->slots) % slab->slot_size == 0 &&
+           static_cast<size_t>(slot - slab->slots) / slab->slot_size < slab->slot_count;
+}
+
+// Function to get a committed chunk for a new slab, reusing a released one when possible
+Slab* slab_chunk_acquire() {
+    Slab* slab = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(slab_pool_mutex);
+        if (slab_pool) {
+            slab = slab_pool;
+            slab_pool = slab->next;
+        }
+    }
+    if (slab) {
+        // A pooled chunk keeps its first page (the descriptor) committed
+        char* rest = reinterpret_cast<char*>(slab) + os_page_size();
+        if (!os_commit(rest, SLAB_SIZE - os_page_size())) {
+            std::lock_guard<std::mutex> lock(slab_pool_mutex);
+            slab->next = slab_pool;
+            slab_pool = slab;
+            return nullptr;
+        }
+        stats_add(thread_stats().committed, SLAB_SIZE - os_page_size());
+        return slab;
+    }
+
+    size_t offset = slab_zone_used.fetch_add(SLAB_SIZE, std::memory_order_relaxed);
+    if (offset + SLAB_SIZE > slab_zone_size) {
+        return nullptr;
+    }
+    if (!os_commit(slab_zone + offset, SLAB_SIZE) ||
+        !radix_insert(slab_zone + offset, SLAB_SIZE, REGION_SLAB, slab_zone + offset)) {
+        return nullptr;
+    }
+    // Chunks never go back to the zone, so the reservation is counted as they are carved from it
+    ThreadStats& stats = thread_stats();
+    stats_add(stats.reserved, SLAB_SIZE);
+    stats_add(stats.committed, SLAB_SIZE);
+    return reinterpret_cast<Slab*>(slab_zone + offset);
+}
+
+// Function to decommit an empty slab's slots and put its chunk in the pool
+void slab_chunk_release(Slab* slab) {
+    slab->slot_size = 0;
+    os_decommit(reinterpret_cast<char*>(slab) + os_page_size(), SLAB_SIZE - os_page_size());
+    stats_sub(thread_stats().committed, SLAB_SIZE - os_page_size());
+
+    std::lock_guard<std::mutex> lock(slab_pool_mutex);
+    slab->next = slab_pool;
+    slab_pool = slab;
+}
+
+// Function to get the slab class that serves requests of the given size
+size_t slab_class(size_t size) {
+    return (size + ALIGNMENT - 1) / ALIGNMENT - 1;
+}
+
+// Function to add a slab to the front of its heap's list of slabs with free slots
+void slab_link(Slab* slab) {
+    Slab*& head = slab->heap->slabs[slab_class(slab->slot_size)];
+    slab->prev = nullptr;
+    slab->next = head;
+    if (head) {
+        head->prev = slab;
+    }
+    head = slab;
+}
+
+// Function to remove a slab from its heap's list of slabs with free slots
+void slab_unlink(Slab* slab) {
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        slab->heap->slabs[slab_class(slab->slot_size)] = slab->next;
+    }
+    if (slab->next) {
+        slab->next->prev = slab->prev;
+    }
+}
+
+// Function to create a slab of the given class for a heap
+Slab* slab_create(Heap* heap, size_t slab_class_index) {
+    Slab* slab = slab_chunk_acquire();
+    if (!slab) {
+        return nullptr;
+    }
+
+    size_t slots_offset = align(sizeof(Slab));
+    slab->heap = heap;
+    slab->slots = reinterpret_cast<char*>(slab) + slots_offset;
+    slab->slot_size = static_cast<uint32_t>((slab_class_index + 1) * ALIGNMENT);
+    slab->slot_count = static_cast<uint32_t>((SLAB_SIZE - slots_offset) / slab->slot_size);
+    slab->free_count = slab->slot_count;
+    slab->search_word = 0;
+    for (size_t word = 0; word < SLAB_MAP_WORDS; ++word) {
+        size_t first = word * 64;
+        size_t count = first >= slab->slot_count ? 0 : std::min(size_t(64), slab->slot_count - first);
+        slab->free_map[word] = count == 64 ? ~uint64_t(0) : (uint64_t(1) << count) - 1;
+    }
+
+    slab_link(slab);
+    return slab;
+}
+
+// Function to allocate a slot of at least the given size from a heap's slabs (owner thread only)
+void* slab_alloc(Heap* heap, size_t size) {
+    size_t slab_class_index = slab_class(size);
+    Slab* slab = heap->slabs[slab_class_index];
+    if (!slab) {
+        slab = slab_create(heap, slab_class_index);
+        if (!slab) {
+            return nullptr;
+        }
+    }
+
+    size_t word = slab->search_word;
+    while (!slab->free_map[word]) {
+        ++word;
+    }
+    int bit = bit_ffs(slab->free_map[word]);
+    slab->free_map[word] &= ~(uint64_t(1) << bit);
+    slab->search_word = static_cast<uint32_t>(word);
+
+    if (--slab->free_count == 0) {
+        slab_unlink(slab);
+    }
+    return slab->slots + (word * 64 + bit) * slab->slot_size;
+}
+
+// Function to return a slot to its slab (owner thread only); an empty slab goes back to the pool
+// unless it is the only one of its class with free slots
+void slab_free(Slab* slab, void* ptr) {
+    size_t index = (static_cast<char*>(ptr) - slab->slots) / slab->slot_size;
+    uint64_t bit = uint64_t(1) << (index % 64);
+    if (slab->free_map[index / 64] & bit) {
+        return;
+    }
+    slab->free_map[index / 64] |= bit;
+    slab->search_word = std::min(slab->search_word, static_cast<uint32_t>(index / 64));
+
+    if (++slab->free_count == 1) {
+        slab_link(slab);
+    } else if (slab->free_count == slab->slot_count && (slab->prev || slab->next)) {
+        slab_unlink(slab);
+        slab_chunk_release(slab);
+    }
+}
+
+// Thread-local caches keep recently freed small blocks and slab slots (still busy as far as their
+// heap is concerned) in per-thread bins, so most small mem_alloc/mem_free pairs never touch a heap
+const size_t TCACHE_GRANULE = 16;
+const size_t TCACHE_MAX_SIZE = 1024;
+const size_t TCACHE_BIN_COUNT = TCACHE_MAX_SIZE / TCACHE_GRANULE;
+const unsigned TCACHE_BIN_LIMIT = 32;  // blocks a bin may hold before a batch is flushed
+const unsigned TCACHE_BATCH = 16;      // blocks moved between a bin and the heap per refill or flush
+
+// TCacheBin structure to represent a stack of cached payloads whose sizes share one size class
+struct TCacheBin {
+    FreeEntry* head;
+    unsigned count;
+};
+
+// TCache structure to represent the per-thread cache and the heap the thread owns
+struct TCache {
+    Heap* heap;
+    ThreadStats* stats;
+    TCacheBin bins[TCACHE_BIN_COUNT];
+    uint32_t guard_countdown;  // mem_alloc calls left before the next sampled one
+    uint32_t guard_seed;       // xorshift state that spaces the samples
+    ~TCache();
+};
+
+thread_local TCache tcache;
+
+// Function to get the calling thread's counters
+ThreadStats& thread_stats() {
+    if (!tcache.stats) {
+        tcache.stats = stats_acquire();
+    }
+    return *tcache.stats;
+}
+
+// Function to decommit the whole pages of a large free block's interior (past its header and links)
+// that overlap the pages of [begin, end)
+void block_decommit(BlockHeader* block, char* begin, char* end) {
+    char* interior_begin = reinterpret_cast<char*>(block + 1) + MIN_BLOCK_SIZE;
+    char* interior_end = reinterpret_cast<char*>(block + 1) + block->size;
+    if (interior_end <= interior_begin ||
+        static_cast<size_t>(interior_end - interior_begin) < decommit_threshold.load(std::memory_order_relaxed)) {
+        return;
+    }
+
+    uintptr_t page_mask = os_page_size() - 1;
+    begin = reinterpret_cast<char*>(reinterpret_cast<uintptr_t>(begin) & ~page_mask);
+    end = reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(end) + page_mask) & ~page_mask);
+    begin = std::max(begin, interior_begin);
+    end = std::min(end, interior_end);
+    if (end > begin) {
+        arena_decommit(block_arena(block), begin, end);
+    }
+}
+
+// Function to hand out a free block, returning its unused tail to the free lists
+void* block_take(BlockHeader* block, size_t size) {
+    if (!arena_commit(block_arena(block), block + 1, reinterpret_cast<char*>(block + 1) + size)) {
+        return nullptr;
+    }
+
+    free_list_remove(block_arena(block)->heap, block);
+    arena_reuse(block_arena(block));
+    block->is_free = false;
+    block_split(block, size);
+    return reinterpret_cast<char*>(block) + sizeof(BlockHeader);
+}
+
+// Function to resize a busy block within its arena, giving back the tail when shrinking and absorbing
+// a free successor when growing (owner thread only)
+bool block_resize(BlockHeader* block, size_t size) {
+    if (block->size < size) {
+        return block_grow(block, size);
+    }
+
+    // The returned tail, and a smaller free successor it merges with, may free whole pages
+    char* dirty_end = reinterpret_cast<char*>(block + 1) + block->size;
+    if (!block->is_last && block_next(block)->is_free &&
+        block_next(block)->size < decommit_threshold.load(std::memory_order_relaxed)) {
+        dirty_end = reinterpret_cast<char*>(block_next(block) + 1) + block_next(block)->size;
+    }
+    block_split(block, size);
+    if (!block->is_last && block_next(block)->is_free) {
+        block_decommit(block_next(block), reinterpret_cast<char*>(block_next(block)), dirty_end);
+    }
+    return true;
+}
+
+// Function to carve up to count busy blocks of the given (aligned) size from the front of a free block
+// in one pass, returning the unused tail to the free lists; returns how many were carved. A count of 0,
+// or a block too small for one, carves nothing and leaves the block untouched
+size_t block_carve(BlockHeader* block, size_t size, size_t count, void** out) {
+    size_t stride = sizeof(BlockHeader) + size;
+    count = std::min(count, static_cast<size_t>(block->size + sizeof(BlockHeader)) / stride);
+    if (count == 0) {
+        return 0;
+    }
+    if (!arena_commit(block_arena(block), block + 1, reinterpret_cast<char*>(block) + count * stride)) {
+        return 0;
+    }
+
+    Arena* arena = block_arena(block);
+    free_list_remove(arena->heap, block);
+    arena_reuse(arena);
+
+    size_t total = block->size;
+    bool is_last = block->is_last;
+    block->is_free = false;
+    for (size_t i = 0; i < count; ++i) {
+        BlockHeader* carved = reinterpret_cast<BlockHeader*>(reinterpret_cast<char*>(block) + i * stride);
+        if (i > 0) {
+            carved->prev_size = size;
+            block_set_arena(carved, arena);
+            carved->magic = block_cookie(carved);
+            carved->is_free = false;
+            carved->is_first = false;
+            carved->is_large = false;
+        }
+        carved->size = size;
+        carved->is_last = false;
+        out[i] = carved + 1;
+    }
+
+    // The last block takes whatever is left, then gives back what it can spare
+    BlockHeader* last = static_cast<BlockHeader*>(out[count - 1]) - 1;
+    last->size = total - (count - 1) * stride;
+    last->is_last = is_last;
+    if (!is_last) {
+        block_next(last)->prev_size = last->size;
+    }
+    block_split(last, size);
+    return count;
+}
+
+// Smallest leading gap that can be split off as a free block in front of an aligned payload
+const size_t FRONT_GAP_MIN = sizeof(BlockHeader) + MIN_BLOCK_SIZE;
+
+// Function to hand out a free block with its payload moved up to the given alignment
+void* block_take_aligned(BlockHeader* block, size_t size, size_t alignment) {
+    uintptr_t payload = reinterpret_cast<uintptr_t>(block + 1);
+    uintptr_t aligned = payload;
+    if (payload & (alignment - 1)) {
+        aligned = (payload + FRONT_GAP_MIN + alignment - 1) & ~(alignment - 1);
+    }
+    char* aligned_block = reinterpret_cast<char*>(aligned) - sizeof(BlockHeader);
+    if (!arena_commit(block_arena(block), aligned_block, reinterpret_cast<char*>(aligned) + size)) {
+        return nullptr;
+    }
+
+    free_list_remove(block_arena(block)->heap, block);
+    arena_reuse(block_arena(block));
+    if (aligned != payload) {
+        block = block_split_front(block, aligned - payload);
+    }
+
+    block->is_free = false;
+    block_split(block, size);
+    return block + 1;
+}
+
+// NextFit structure to represent a fit policy that walks each arena's blocks in address order from
+// where the previous search stopped, spreading allocations instead of piling them at the front
+struct NextFit {
+    static BlockHeader* find(Heap* heap, size_t size) {
+        Arena* first = heap->rover ? heap->rover : heap->arena_list;
+        Arena* arena = first;
+        while (arena) {
+            BlockHeader* block = arena->rover;
+            do {
+                if (block->is_free && block->size >= size) {
+                    arena->rover = block;
+                    heap->rover = arena;
+                    return block;
+                }
+                block = block->is_last ? static_cast<BlockHeader*>(arena->base) : block_next(block);
+            } while (block != arena->rover);
+
+            arena = arena->next ? arena->next : heap->arena_list;
+            if (arena == first) {
+                break;
+            }
+        }
+        return nullptr;
+    }
+};
+
+// RuntimeFit structure to represent the fit policy of the mem_* functions, which follows fit_strategy
+struct RuntimeFit {
+    static BlockHeader* find(Heap* heap, size_t size) {
+        switch (fit_strategy.load(std::memory_order_relaxed)) {
+            case FIT_EXACT:
+                return ExactFit::find(heap, size);
+            case FIT_BEST:
+                return BestFit::find(heap, size);
+            case FIT_NEXT:
+                return NextFit::find(heap, size);
+            default:
+                return GoodFit::find(heap, size);
+        }
+    }
+};
+
+// Function to allocate a block of memory from the free lists of a heap's arenas
+template <typename FitPolicy = GoodFit>
+void* block_alloc(Heap* heap, size_t size) {
+    size = std::max(align(size), MIN_BLOCK_SIZE);
+
+    BlockHeader* block = FitPolicy::find(heap, size);
+    if (!block) {
+        return nullptr;
+    }
+    return block_take(block, size);
+}
+
+// Function to return a busy block to the heap that owns it (only the owner thread may call this)
+void heap_free(BlockHeader* block) {
+    // Without the scavenger, free blocks at or above decommit_threshold never keep committed interior
+    // pages, so only the freed span and any smaller free neighbour it absorbs can hold pages to give back
+    size_t threshold = decommit_threshold.load(std::memory_order_relaxed);
+    char* dirty_begin = reinterpret_cast<char*>(block);
+    char* dirty_end = reinterpret_cast<char*>(block_next(block) + 1) + MIN_BLOCK_SIZE;
+    if (!block->is_first && block_prev(block)->is_free && block_prev(block)->size < threshold) {
+        dirty_begin = reinterpret_cast<char*>(block_prev(block));
+    }
+    if (!block->is_last && block_next(block)->is_free && block_next(block)->size < threshold) {
+        dirty_end = reinterpret_cast<char*>(block_next(block) + 1) + block_next(block)->size;
+    }
+
+    block->is_free = true;
+    block = block_unite(block);
+    free_list_insert(block_arena(block)->heap, block);
+    if (scavenger_running.load(std::memory_order_relaxed)) {
+        // The scavenger decommits the arena's free pages once it has gone a whole period without frees
+        block_arena(block)->freed_epoch = scavenge_epoch.load(std::memory_order_relaxed);
+    } else {
+        block_decommit(block, dirty_begin, dirty_end);
+    }
+
+    if (block->is_first && block->is_last) {
+        arena_retire(block_arena(block));
+    }
+}
+
+// Function to become the stand-in owner of an abandoned heap, unless another thread already is
+bool heap_claim(Heap* heap) {
+    bool abandoned = true;
+    return heap->abandoned.compare_exchange_strong(abandoned, false, std::memory_order_acquire);
+}
+
+void heap_orphan_drain(Heap* heap);
+
+// Function to push an entry onto one of a heap's lock-free stacks; a heap whose owner has exited is
+// drained on the spot by the pushing thread if it wins the claim, and otherwise by whoever holds it
+void heap_push(Heap* heap, std::atomic<FreeEntry*>& stack, FreeEntry* entry) {
+    entry->next = stack.load(std::memory_order_relaxed);
+    while (!stack.compare_exchange_weak(entry->next, entry, std::memory_order_release, std::memory_order_relaxed)) {
+    }
+    if (heap->abandoned.load(std::memory_order_acquire) && heap_claim(heap)) {
+        heap_orphan_drain(heap);
+    }
+}
+
+// Function to hand a block payload or slot owned by another thread's heap to that heap without taking any lock
+void heap_remote_free(Heap* heap, void* ptr) {
+    heap_push(heap, heap->remote_free, static_cast<FreeEntry*>(ptr));
+}
+
+// Blocks the scavenger hands back that one drain puts back on the free lists, so an owner's allocation
+// never has a whole period's worth to merge
+const size_t SCAVENGED_DRAIN_LIMIT = 64;
+
+// Mixed into the cookie of a free block the scavenger has taken off the free lists
+const uint32_t SCAVENGE_COOKIE = 0x53435647;
+
+// Function to get the cookie of a block the scavenger holds; block_from_ptr turns such a block away,
+// so mem_free and the other entry points ignore a free of it as they ignore a free of any free block
+uint32_t scavenge_cookie(const BlockHeader* block) {
+    return block_cookie(block) ^ SCAVENGE_COOKIE;
+}
+
+// Function to put up to limit of the blocks the scavenger has finished with back on the free lists
+void heap_drain_scavenged(Heap* heap, size_t limit) {
+    if (!heap->scavenged_pending) {
+        if (!heap->scavenged_free.load(std::memory_order_relaxed)) {
+            return;
+        }
+        heap->scavenged_pending = heap->scavenged_free.exchange(nullptr, std::memory_order_acquire);
+    }
+    for (; heap->scavenged_pending && limit; --limit) {
+        FreeEntry* entry = heap->scavenged_pending;
+        heap->scavenged_pending = entry->next;
+        BlockHeader* block = reinterpret_cast<BlockHeader*>(entry) - 1;
+        block->magic = block_cookie(block);
+        heap_free(block);
+    }
+}
+
+// Function to free the blocks and slots other threads have handed back to a heap
+void heap_drain_remote(Heap* heap) {
+    heap_drain_scavenged(heap, SCAVENGED_DRAIN_LIMIT);
+    if (!heap->remote_free.load(std::memory_order_relaxed)) {
+        return;
+    }
+    FreeEntry* entry = heap->remote_free.exchange(nullptr, std::memory_order_acquire);
+    while (entry) {
+        FreeEntry* next = entry->next;
+        if (Slab* slab = slab_of(entry)) {
+            slab_free(slab, entry);
+        } else {
+            // handle blocks freed by other threads still carry the handle cookie, which only the owner may reset
+            BlockHeader* block = reinterpret_cast<BlockHeader*>(entry) - 1;
+            block->magic = block_cookie(block);
+            heap_free(block);
+        }
+        entry = next;
+    }
+}
+
+// Function to allocate memory from a heap (only the owner thread may call this)
+template <typename FitPolicy = GoodFit>
+void* heap_alloc(Heap* heap, size_t size) {
+    heap_drain_remote(heap);
+
+    if (void* ptr = block_alloc<FitPolicy>(heap, size)) {
+        return ptr;
+    }
+
+    Arena* new_arena = arena_create(heap, size + sizeof(BlockHeader));
+    if (!new_arena) {
+        return nullptr;
+    }
+
+    // The fresh block may sit in the same size class as the request, which the rounded
+    // search skips, so take it directly
+    return block_take(static_cast<BlockHeader*>(new_arena->base), size);
+}
+
+// Function to allocate zeroed memory from a heap, clearing only what the chosen block has committed
+// (owner thread only)
+template <typename FitPolicy = GoodFit>
+void* heap_calloc(Heap* heap, size_t size) {
+    heap_drain_remote(heap);
+    size = std::max(align(size), MIN_BLOCK_SIZE);
+
+    BlockHeader* block = FitPolicy::find(heap, size);
+    if (!block) {
+        Arena* new_arena = arena_create(heap, size + sizeof(BlockHeader));
+        if (!new_arena) {
+            return nullptr;
+        }
+        block = static_cast<BlockHeader*>(new_arena->base);
+    }
+
+    // The block is still free, so its links at the front of the payload are cleared after the take
+    char* payload = reinterpret_cast<char*>(block + 1);
+    arena_clear_committed(block_arena(block), payload + MIN_BLOCK_SIZE, payload + size);
+    void* ptr = block_take(block, size);
+    if (ptr) {
+        memset(ptr, 0, MIN_BLOCK_SIZE);
+    }
+    return ptr;
+}
+
+// Function to allocate memory with an alignment above the default from a heap (owner thread only)
+template <typename FitPolicy = GoodFit>
+void* heap_alloc_aligned(Heap* heap, size_t size, size_t alignment) {
+    heap_drain_remote(heap);
+
+    // Enough room to move the payload up to the boundary and still split off the gap in front
+    size_t padded = size + alignment + FRONT_GAP_MIN;
+    BlockHeader* block = FitPolicy::find(heap, padded);
+    if (!block) {
+        Arena* new_arena = arena_create(heap, padded + sizeof(BlockHeader));
+        if (!new_arena) {
+            return nullptr;
+        }
+        block = static_cast<BlockHeader*>(new_arena->base);
+    }
+    return block_take_aligned(block, size, alignment);
+}
+
+// Function to get the size of a heap's largest free block; only its highest non-empty size class is walked
+size_t heap_largest_free(Heap* heap) {
+    if (!heap->fl_bitmap) {
+        return 0;
+    }
+    int fl = bit_fls(heap->fl_bitmap);
+    int sl = bit_fls(heap->sl_bitmap[fl]);
+    size_t largest = 0;
+    for (BlockHeader* block = heap->free_lists[fl][sl]; block; block = block_links(block)->next) {
+        largest = std::max(largest, static_cast<size_t>(block->size));
+    }
+    return largest;
+}
+
+// Function to measure a heap's external fragmentation: the share of its free arena bytes that lie
+// outside the largest free block
+double heap_fragmentation(Heap* heap) {
+    return heap->free_bytes ? 1.0 - static_cast<double>(heap_largest_free(heap)) / heap->free_bytes : 0.0;
+}
+
+// Function to take over the heap of an exited thread, or create a heap for the calling thread; a heap
+// last owned by a thread on the calling thread's NUMA node is preferred. The search goes round-robin
+// from the heap adopted last, so no abandoned heap is passed over for good. Nothing of an abandoned
+// heap but its flag and home_node is read before it is claimed: a freeing thread that holds the claim
+// may be releasing its arenas.
+Heap* heap_acquire() {
+    int node = thread_node();
+    std::lock_guard<std::mutex> lock(heap_list_mutex);
+    Heap* start = heap_adopt_cursor && heap_adopt_cursor->next ? heap_adopt_cursor->next : heap_list;
+    Heap* heap = start;
+    Heap* fallback = nullptr;
+    do {
+        if (heap && heap->abandoned.load(std::memory_order_relaxed)) {
+            if (node == NODE_ANY || heap->home_node == node) {
+                if (heap_claim(heap)) {
+                    heap->home_node = node;
+                    heap_adopt_cursor = heap;
+                    return heap;
+                }
+            } else {
+                fallback = fallback ? fallback : heap;
+            }
+        }
+        heap = heap && heap->next ? heap->next : heap_list;
+    } while (heap != start);
+    if (fallback && heap_claim(fallback)) {
+        fallback->home_node = node;
+        heap_adopt_cursor = fallback;
+        return fallback;
+    }
+
+    heap = new Heap();
+    heap->home_node = node;
+    heap->next = heap_list;
+    heap_list = heap;
+    return heap;
+}
+
+// Function to release the spare arenas of a heap nobody owns any more (the scavenger trims them itself
+// while it runs)
+void heap_release_spares(Heap* heap) {
+    if (scavenger_running.load(std::memory_order_relaxed)) {
+        return;
+    }
+    for (Arena* arena = heap->arena_list; arena && heap->spare_arenas;) {
+        Arena* next = arena->next;
+        if (arena->is_spare) {
+            arena_reuse(arena);
+            arena_release(arena);
+        }
+        arena = next;
+    }
+}
+
+// Function to free what has been handed back to a heap that was just given up or claimed, release its
+// spare arenas and leave it abandoned again; frees that slip in before the heap is marked abandoned
+// are picked up by going round again. Only the exiting owner or the thread that won heap_claim may
+// call this, so a single thread at a time works on the heap's free lists.
+void heap_orphan_drain(Heap* heap) {
+    // The blocks are freed as if the heap were the calling thread's own
+    Heap* own = tcache.heap;
+    tcache.heap = heap;
+    do {
+        heap_drain_remote(heap);
+        heap_drain_scavenged(heap, SIZE_MAX);
+        heap_release_spares(heap);
+        heap->abandoned.store(true, std::memory_order_release);
+    } while ((heap->remote_free.load(std::memory_order_acquire) ||
+              heap->scavenged_free.load(std::memory_order_acquire)) && heap_claim(heap));
+    tcache.heap = own;
+}
+
+// Function to give up a heap when its owner thread exits; what is freed into it later is freed by the
+// thread that frees it, so the heap's empty arenas go back to the OS even if no thread adopts it
+void heap_abandon(Heap* heap) {
+    heap_orphan_drain(heap);
+}
+
+// Scavenger: an optional background thread that takes the decommit and munmap/VirtualFree calls off
+// the threads that free memory. Heaps stay owner-only: once a period each owner, at its next
+// allocation, hands over what has gone idle (it takes the blocks off its free lists and unlinks
+// the arenas), the scavenger makes the OS calls and sends the blocks back through the heap's
+// scavenged_free stack, a bounded number of which each drain puts back. The hand-over is done a
+// bounded slice per allocation. Heaps of exited threads are adopted by the scavenger for it, and
+// heaps with a stand-in lock (node heaps, shared Allocator instances) are handed over by the
+// scavenger while it holds their lock.
+
+std::mutex scavenge_mutex;              // guards the queues below and scavenger_running changes
+std::mutex scavenge_drain_mutex;        // held while the queues taken out are worked through
+FreeEntry* scavenge_blocks = nullptr;   // free blocks whose interior pages are to be decommitted
+Arena* scavenge_arenas = nullptr;       // detached arenas to be released, linked through Arena::next
+
+// Most arenas and free blocks one call of heap_scavenge looks at
+const size_t SCAVENGE_BUDGET = 64;
+
+// Function to release an empty arena past the retention limits: queued for the scavenger while it
+// runs, else returned to the OS at once
+void scavenge_release_arena(Arena* arena) {
+    arena_detach(arena);
+    {
+        std::lock_guard<std::mutex> lock(scavenge_mutex);
+        if (scavenger_running.load(std::memory_order_relaxed)) {
+            arena_unregister(arena);
+            arena->next = scavenge_arenas;
+            scavenge_arenas = arena;
+            return;
+        }
+    }
+    arena_unmap(arena);
+}
+
+// Function to get the whole pages of a free block's interior (past its header and links)
+void block_interior_pages(BlockHeader* block, char*& begin, char*& end) {
+    uintptr_t page_mask = os_page_size() - 1;
+    begin = reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(block + 1) + MIN_BLOCK_SIZE + page_mask) & ~page_mask);
+    end = reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(block + 1) + block->size) & ~page_mask);
+}
+
+// Function to check whether any page of an arena's range [begin, end) is committed
+bool arena_any_committed(const Arena* arena, char* begin, char* end) {
+    const char* base = reinterpret_cast<const char*>(arena);
+    for (size_t page = (begin - base) / os_page_size(); page < static_cast<size_t>(end - base) / os_page_size(); ++page) {
+        if (arena_page_committed(arena, page)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Function to hand the scavenger a slice of a heap's work for a period (owner only): spare arenas past
+// their time are detached, and free blocks with committed interior pages in arenas no block was freed
+// into for the whole last period are taken off the free lists. Spares beyond the retention limits go
+// after one idle period, the others after scavenge_decay periods. Each call looks at no more than
+// SCAVENGE_BUDGET arenas and free blocks, and the next call resumes where it stopped; returns
+// whether the heap's work for the period has all been handed over.
+bool heap_scavenge(Heap* heap, uint64_t epoch) {
+    std::lock_guard<std::mutex> lock(scavenge_mutex);
+    size_t threshold = decommit_threshold.load(std::memory_order_relaxed);
+    const int class_count = FL_INDEX_COUNT * SL_INDEX_COUNT;
+    if (!scavenger_running.load(std::memory_order_relaxed)) {
+        heap->scavenge_class = class_count;
+        heap->scavenge_block = nullptr;
+        heap->scavenge_rover = nullptr;
+    } else if (heap->scavenge_class < 0) {
+        // Smaller classes only hold blocks below the threshold
+        int fl, sl;
+        mapping_insert(std::min(threshold + MIN_BLOCK_SIZE, MAX_BLOCK_SIZE), fl, sl);
+        heap->scavenge_class = fl * SL_INDEX_COUNT + sl;
+        heap->scavenge_block = nullptr;
+        heap->scavenge_rover = heap->arena_list;
+    }
+
+    uint64_t decay = scavenge_decay.load(std::memory_order_relaxed);
+    size_t budget = SCAVENGE_BUDGET;
+    for (; heap->scavenge_rover && budget; --budget) {
+        Arena* arena = heap->scavenge_rover;
+        heap->scavenge_rover = arena->next;
+        if (!arena->is_spare || arena->freed_epoch + 1 >= epoch || arena->is_large_pages) {
+            continue;
+        }
+        bool over_limits = heap->spare_arenas > arena_retain_count.load(std::memory_order_relaxed) ||
+                           heap->spare_bytes > arena_retain_bytes.load(std::memory_order_relaxed);
+        if (over_limits || arena->freed_epoch + decay <= epoch) {
+            arena_reuse(arena);
+            arena_detach(arena);
+            arena_unregister(arena);
+            arena->next = scavenge_arenas;
+            scavenge_arenas = arena;
+        }
+    }
+
+    // The cursor is moved past each block before it is looked at, and free_list_remove moves it on
+    // when the owner takes the block it rests on between calls
+    while (!heap->scavenge_rover && heap->scavenge_class < class_count && budget) {
+        BlockHeader* block = heap->scavenge_block;
+        if (!block) {
+            block = heap->free_lists[heap->scavenge_class / SL_INDEX_COUNT][heap->scavenge_class % SL_INDEX_COUNT];
+            if (!block) {
+                ++heap->scavenge_class;
+                continue;
+            }
+        }
+        heap->scavenge_block = block_links(block)->next;
+        heap->scavenge_class += heap->scavenge_block ? 0 : 1;
+        --budget;
+
+        Arena* arena = block_arena(block);
+        char* begin;
+        char* end;
+        block_interior_pages(block, begin, end);
+        if (arena->freed_epoch + 1 >= epoch || arena->is_large_pages || block->size - MIN_BLOCK_SIZE < threshold ||
+            end <= begin || !arena_any_committed(arena, begin, end)) {
+            continue;
+        }
+        // Busy to its neighbours while the scavenger has it, so none merges with it, but it carries the
+        // scavenge cookie, so a second free of it is turned away as if it were still free
+        free_list_remove(heap, block);
+        arena_reuse(arena);
+        block->is_free = false;
+        block->magic = scavenge_cookie(block);
+        arena_decommit(arena, begin, end, true);
+        FreeEntry* entry = reinterpret_cast<FreeEntry*>(block + 1);
+        entry->next = scavenge_blocks;
+        scavenge_blocks = entry;
+    }
+
+    if (heap->scavenge_rover || heap->scavenge_class < class_count) {
+        return false;
+    }
+    heap->scavenge_class = -1;
+    heap->scavenge_block = nullptr;
+    heap->scavenged_epoch.store(epoch, std::memory_order_relaxed);
+    return true;
+}
+
+// Function to make the OS calls for everything handed to the scavenger and send the blocks home
+void scavenge_drain() {
+    std::lock_guard<std::mutex> drain_lock(scavenge_drain_mutex);
+    FreeEntry* blocks;
+    Arena* arenas;
+    {
+        std::lock_guard<std::mutex> lock(scavenge_mutex);
+        blocks = scavenge_blocks;
+        arenas = scavenge_arenas;
+        scavenge_blocks = nullptr;
+        scavenge_arenas = nullptr;
+    }
+    while (blocks) {
+        FreeEntry* next = blocks->next;
+        BlockHeader* block = reinterpret_cast<BlockHeader*>(blocks) - 1;
+        char* begin;
+        char* end;
+        block_interior_pages(block, begin, end);
+        os_decommit(begin, end - begin);
+        Heap* heap = block_arena(block)->heap;
+        heap_push(heap, heap->scavenged_free, blocks);
+        blocks = next;
+    }
+    while (arenas) {
+        Arena* next = arenas->next;
+        os_release(arenas, arenas->reserved);
+        arenas = next;
+    }
+}
+
+// Function to run one scavenger period: start it, stand in for the owners of abandoned heaps and of
+// heaps with a stand-in lock, and carry out what every heap has handed over so far
+void scavenge_round() {
+    uint64_t epoch = ++scavenge_epoch;
+    {
+        // A heap whose lock is busy is in use, and hands its work over at its next allocation
+        std::lock_guard<std::mutex> lock(heap_list_mutex);
+        for (Heap* heap = heap_list; heap; heap = heap->next) {
+            if (heap->stand_in_lock && heap->scavenged_epoch.load(std::memory_order_relaxed) != epoch &&
+                heap->stand_in_lock->try_lock()) {
+                heap_drain_remote(heap);
+                while (!heap_scavenge(heap, epoch)) {
+                }
+                heap->stand_in_lock->unlock();
+            }
+        }
+    }
+    for (;;) {
+        Heap* heap = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(heap_list_mutex);
+            for (Heap* candidate = heap_list; candidate; candidate = candidate->next) {
+                if (candidate->scavenged_epoch.load(std::memory_order_relaxed) != epoch && heap_claim(candidate)) {
+                    heap = candidate;
+                    break;
+                }
+            }
+        }
+        if (!heap) {
+            break;
+        }
+        tcache.heap = heap;
+        heap_drain_remote(heap);
+        while (!heap_scavenge(heap, epoch)) {
+        }
+        scavenge_drain();
+        heap_abandon(heap);  // frees the blocks just sent back
+        tcache.heap = nullptr;
+    }
+    scavenge_drain();
+}
+
+// Scavenger structure to represent the background thread and how to stop it
+struct Scavenger {
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool stopping = false;
+
+    ~Scavenger();
+};
+
+Scavenger scavenger;
+
+// Function to start the scavenger with the given period; returns false if it is already running
+bool mem_scavenger_start(std::chrono::milliseconds period) {
+    std::lock_guard<std::mutex> lock(scavenger.mutex);
+    if (scavenger.thread.joinable()) {
+        return false;
+    }
+    {
+        std::lock_guard<std::mutex> queue_lock(scavenge_mutex);
+        scavenger_running = true;
+    }
+    scavenger.stopping = false;
+    scavenger.thread = std::thread([period] {
+        std::unique_lock<std::mutex> lock(scavenger.mutex);
+        while (!scavenger.wake.wait_for(lock, period, [] { return scavenger.stopping; })) {
+            lock.unlock();
+            scavenge_round();
+            lock.lock();
+        }
+    });
+    return true;
+}
+
+// Function to stop the scavenger; frees go back to decommitting inline, though free blocks that
+// were left committed while it ran keep their pages until they are reused
+void mem_scavenger_stop() {
+    std::thread thread;
+    {
+        std::lock_guard<std::mutex> lock(scavenger.mutex);
+        if (!scavenger.thread.joinable()) {
+            return;
+        }
+        scavenger.stopping = true;
+        thread = std::move(scavenger.thread);
+    }
+    scavenger.wake.notify_all();
+    thread.join();
+    {
+        std::lock_guard<std::mutex> lock(scavenge_mutex);
+        scavenger_running = false;
+    }
+    // Nothing can be handed over any more; finish what was
+    scavenge_drain();
+}
+
+// Stop the thread before the globals it uses go away
+Scavenger::~Scavenger() {
+    mem_scavenger_stop();
+}
+
+// Function to get the heap owned by the calling thread
+Heap* thread_heap() {
+    if (!tcache.heap) {
+        tcache.heap = heap_acquire();
+    }
+    uint64_t epoch = scavenge_epoch.load(std::memory_order_relaxed);
+    if (tcache.heap->scavenged_epoch.load(std::memory_order_relaxed) != epoch) {
+        heap_scavenge(tcache.heap, epoch);
+    }
+    return tcache.heap;
+}
+
+// NodeHeap structure to represent the heap mem_alloc_on_node serves a NUMA node from; no thread owns
+// it, so whoever holds the mutex acts as the owner; blocks freed into it are freed under the mutex too
+struct NodeHeap {
+    std::mutex mutex;
+    Heap* heap = nullptr;
+};
+
+NodeHeap node_heaps[NODE_LIMIT];
+
+// Function to check whether a heap is the heap of a NUMA node rather than of a thread
+bool heap_is_node(const Heap* heap) {
+    return heap->node != NODE_ANY;
+}
+
+// Function to free a block into the node heap that owns it, taking the node's mutex to act as its owner;
+// what other threads have handed back meanwhile is freed with it, so nothing waits for the next allocation
+void node_heap_free(Heap* heap, BlockHeader* block) {
+    std::lock_guard<std::mutex> lock(node_heaps[heap->node].mutex);
+    heap_drain_remote(heap);
+    heap_free(block);
+}
+
+// Function to release a busy block: directly into our own heap or its node heap, or through the owner's
+// remote list
+void block_release(BlockHeader* block) {
+    Heap* heap = block_arena(block)->heap;
+    if (heap == tcache.heap) {
+        heap_free(block);
+    } else if (heap_is_node(heap)) {
+        node_heap_free(heap, block);
+    } else {
+        heap_remote_free(heap, block + 1);
+    }
+}
+
+// Function to release a busy slab slot or block payload to the heap that owns it
+void ptr_release(void* ptr) {
+    if (Slab* slab = slab_of(ptr)) {
+        if (slab->heap == tcache.heap) {
+            slab_free(slab, ptr);
+        } else {
+            heap_remote_free(slab->heap, ptr);
+        }
+        return;
+    }
+    block_release(static_cast<BlockHeader*>(ptr) - 1);
+}
+
+// Function to get the cache bin whose blocks are all large enough for a request
+size_t tcache_bin_for_request(size_t size) {
+    return (size + TCACHE_GRANULE - 1) / TCACHE_GRANULE - 1;
+}
+
+// Function to get the cache bin a block or slot of the given payload size is kept in
+size_t tcache_bin_for_block(size_t size) {
+    return size / TCACHE_GRANULE - 1;
+}
+
+// Function to get the marker stored in cached payloads, used to catch a double free cheaply
+void* tcache_key() {
+    return &tcache;
+}
+
+// Function to push a payload onto a cache bin
+void tcache_push(TCacheBin& bin, void* ptr) {
+    FreeEntry* entry = static_cast<FreeEntry*>(ptr);
+    entry->next = bin.head;
+    entry->key = tcache_key();
+    bin.head = entry;
+    ++bin.count;
+}
+
+// Function to pop a payload from a non-empty cache bin
+void* tcache_pop(TCacheBin& bin) {
+    FreeEntry* entry = bin.head;
+    bin.head = entry->next;
+    entry->key = nullptr;
+    --bin.count;
+    return entry;
+}
+
+// Function to check whether a payload bearing the cache marker really is in the bin
+bool tcache_contains(const TCacheBin& bin, void* ptr) {
+    for (FreeEntry* cached = bin.head; cached; cached = cached->next) {
+        if (cached == ptr) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Function to fill an empty cache bin with a batch of slots or blocks from the thread's own heap; only
+// the first may take a new slab or arena, so the batch stops short where the current ones run out
+void tcache_refill(size_t index) {
+    TCacheBin& bin = tcache.bins[index];
+    size_t size = (index + 1) * TCACHE_GRANULE;
+
+    Heap* heap = thread_heap();
+    for (unsigned i = 0; i < TCACHE_BATCH; ++i) {
+        void* ptr = nullptr;
+        if (i == 0) {
+            ptr = size <= SLAB_MAX_SIZE ? slab_alloc(heap, size) : nullptr;
+            if (!ptr) {
+                ptr = heap_alloc<RuntimeFit>(heap, size);
+            }
+        } else if (size <= SLAB_MAX_SIZE) {
+            ptr = heap->slabs[slab_class(size)] ? slab_alloc(heap, size) : nullptr;
+        } else {
+            ptr = block_alloc<RuntimeFit>(heap, size);
+        }
+        if (!ptr) {
+            break;
+        }
+        tcache_push(bin, ptr);
+    }
+}
+
+// Function to return up to count payloads from a cache bin to the heaps that own them
+void tcache_flush(TCacheBin& bin, unsigned count) {
+    while (bin.head && count--) {
+        ptr_release(tcache_pop(bin));
+    }
+}
+
+// Function to park a busy block or slot of the given size in the calling thread's cache, flushing a
+// batch to the heaps once the bin is over its limit (pointers already in the bin are ignored)
+void tcache_free(void* ptr, size_t size) {
+    TCacheBin& bin = tcache.bins[tcache_bin_for_block(size)];
+    if (static_cast<FreeEntry*>(ptr)->key == tcache_key() && tcache_contains(bin, ptr)) {
+        return;
+    }
+    tcache_push(bin, ptr);
+    if (bin.count > TCACHE_BIN_LIMIT) {
+        tcache_flush(bin, TCACHE_BATCH);
+    }
+}
+
+// Hand every cached block back to its owner and give up the heap when the thread exits
+TCache::~TCache() {
+    for (TCacheBin& bin : bins) {
+        tcache_flush(bin, bin.count);
+    }
+    if (heap) {
+        heap_abandon(heap);
+    }
+    if (stats) {
+        stats_abandon(stats);
+        stats = nullptr;
+    }
+}
+
+// Allocation tracing: while a trace is running, every mem_alloc/mem_realloc/mem_free call is appended
+// to a buffer owned by the calling thread, without locks or atomics read-modify-writes; a full buffer
+// is written to the log as one chunk, so the shared mutex is taken once per TRACE_CHUNK_RECORDS calls.
+// Log format: chunks, each a TraceChunk header followed by its records.
+
+// Kinds of call a trace records
+enum TraceOp : uint32_t { TRACE_ALLOC, TRACE_FREE, TRACE_REALLOC };
+
+// TraceRecord structure to represent one traced call
+struct TraceRecord {
+    uint32_t delta;   // nanoseconds since the previous record of the chunk (the first: since the chunk's start)
+    uint32_t op;      // TraceOp
+    uint64_t size;    // requested size
+    uint64_t ptr;     // pointer an allocation returned, or the one freed or reallocated
+    uint64_t result;  // pointer a reallocation returned
+};
+
+// TraceChunk structure to represent the header in front of a run of records from one thread
+struct TraceChunk {
+    uint32_t magic;
+    uint32_t thread;  // small id of the recording thread, in order of first traced call
+    uint64_t start;   // steady clock nanoseconds the chunk's deltas count from
+    uint64_t count;   // records that follow
+};
+
+const uint32_t TRACE_MAGIC = 0x54524143;
+const size_t TRACE_CHUNK_RECORDS = 4096;
+
+// TraceBuffer structure to represent the records a thread has not written to the log yet
+struct TraceBuffer {
+    TraceChunk chunk;
+    uint64_t last;     // time of the latest record
+    unsigned session;  // trace the records belong to
+    TraceRecord records[TRACE_CHUNK_RECORDS];
+
+    ~TraceBuffer();
+};
+
+std::atomic<bool> trace_enabled{false};
+std::atomic<unsigned> trace_session{0};
+std::atomic<uint32_t> trace_thread_count{0};
+std::mutex trace_mutex;  // guards trace_file
+FILE* trace_file = nullptr;
+thread_local std::unique_ptr<TraceBuffer> trace_buffer;
+
+// Function to read the clock trace records are stamped with
+uint64_t trace_now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Function to write a thread's buffered records to the log as one chunk; records of a trace that has
+// since stopped are dropped
+void trace_flush(TraceBuffer& buffer) {
+    if (buffer.chunk.count) {
+        std::lock_guard<std::mutex> lock(trace_mutex);
+        if (trace_file && buffer.session == trace_session.load()) {
+            fwrite(&buffer.chunk, sizeof(buffer.chunk), 1, trace_file);
+            fwrite(buffer.records, sizeof(TraceRecord), buffer.chunk.count, trace_file);
+        }
+    }
+    buffer.chunk.count = 0;
+}
+
+// Write out what is left when the thread exits
+TraceBuffer::~TraceBuffer() {
+    trace_flush(*this);
+}
+
+// Function to append one call to the calling thread's trace buffer
+void trace_record(TraceOp op, size_t size, const void* ptr, const void* result) {
+    TraceBuffer* buffer = trace_buffer.get();
+    if (!buffer) {
+        trace_buffer.reset(buffer = new TraceBuffer());
+        buffer->chunk.magic = TRACE_MAGIC;
+        buffer->chunk.thread = trace_thread_count++;
+        buffer->chunk.count = 0;
+    }
+
+    uint64_t now = trace_now();
+    unsigned session = trace_session.load(std::memory_order_relaxed);
+    if (buffer->session != session) {
+        buffer->chunk.count = 0;
+        buffer->session = session;
+    }
+    // A chunk also ends when the gap since the last record no longer fits a delta
+    if (buffer->chunk.count == TRACE_CHUNK_RECORDS || (buffer->chunk.count && now - buffer->last > UINT32_MAX)) {
+        trace_flush(*buffer);
+    }
+    if (!buffer->chunk.count) {
+        buffer->chunk.start = buffer->last = now;
+    }
+
+    TraceRecord& record = buffer->records[buffer->chunk.count++];
+    record.delta = static_cast<uint32_t>(now - buffer->last);
+    record.op = op;
+    record.size = size;
+    record.ptr = reinterpret_cast<uintptr_t>(ptr);
+    record.result = reinterpret_cast<uintptr_t>(result);
+    buffer->last = now;
+}
+
+// Function to start tracing every thread's calls into a new log file; returns false if it cannot be created
+bool trace_start(const char* path) {
+    std::lock_guard<std::mutex> lock(trace_mutex);
+    if (trace_file) {
+        return false;
+    }
+    trace_file = fopen(path, "wb");
+    if (!trace_file) {
+        return false;
+    }
+    ++trace_session;
+    trace_enabled = true;
+    return true;
+}
+
+// Function to stop tracing and close the log; the calling thread's records are written out, those
+// other threads still buffer are written only if they exited before (join them first)
+void trace_stop() {
+    trace_enabled = false;
+    if (trace_buffer) {
+        trace_flush(*trace_buffer);
+    }
+    std::lock_guard<std::mutex> lock(trace_mutex);
+    if (trace_file) {
+        fclose(trace_file);
+        trace_file = nullptr;
+    }
+}
+
+// Guard sampling: a debug mode cheap enough to leave on in production. One in about guard_sample_rate
+// mem_alloc calls (for at most a page) is served from a slot of the guard pool, a page of its own
+// between two pages that are never committed, with the allocation placed against the page after it.
+// A free makes the page inaccessible and sends the slot to the back of a FIFO, which quarantines it
+// until every other slot has been used. Overflows and use-after-free then fault at once, and a fault
+// handler reports the slot with the stacks that allocated and freed it.
+
+const size_t GUARD_SLOT_COUNT = 512;
+const uint32_t GUARD_STACK_DEPTH = 16;
+
+std::atomic<uint32_t> guard_sample_rate{0};     // 0 while sampling is off
+std::atomic<bool> guard_record_stacks{false};
+
+// GuardSlot structure to represent one slot of the guard pool
+struct GuardSlot {
+    char* ptr;               // last allocation served from the slot, nullptr before the first
+    size_t size;             // its rounded size
+    bool is_freed;           // freed, with its page inaccessible
+    uint32_t alloc_depth;
+    uint32_t free_depth;
+    void* alloc_stack[GUARD_STACK_DEPTH];
+    void* free_stack[GUARD_STACK_DEPTH];
+};
+
+// Pool reserved once: slot i has the page at index 2 * i + 1, and every even page is a guard page
+const size_t GUARD_POOL_PAGES = 2 * GUARD_SLOT_COUNT + 1;
+char* const guard_pool = static_cast<char*>(os_reserve(GUARD_POOL_PAGES * os_page_size()));
+const size_t guard_pool_size = guard_pool ? GUARD_POOL_PAGES * os_page_size() : 0;
+std::mutex guard_mutex;                // guards the slots and the queue
+GuardSlot guard_slots[GUARD_SLOT_COUNT];
+uint32_t guard_queue[GUARD_SLOT_COUNT];  // ring of the slots ready for use, oldest free first
+size_t guard_queue_head = 0;
+size_t guard_queue_count = 0;
+bool guard_queue_filled = false;
+
+// Function to check whether a pointer lies in the guard pool
+bool guard_owns(const void* ptr) {
+    return reinterpret_cast<uintptr_t>(ptr) - reinterpret_cast<uintptr_t>(guard_pool) < guard_pool_size;
+}
+
+// Function to record the calling stack, returning the number of frames taken
+uint32_t guard_capture_stack(void** frames) {
+    if (!guard_record_stacks.load(std::memory_order_relaxed)) {
+        return 0;
+    }
+#ifdef _WIN32
+    return CaptureStackBackTrace(1, GUARD_STACK_DEPTH, frames, nullptr);
+#elif defined(__GLIBC__) || defined(__APPLE__)
+    return static_cast<uint32_t>(backtrace(frames, GUARD_STACK_DEPTH));
+#else
+    (void)frames;
+    return 0;
+#endif
+}
+
+// Function to write a line of a guard report to stderr (safe to call from the fault handler)
+void guard_report(const char* line) {
+#ifdef _WIN32
+    fputs(line, stderr);
+#else
+    ssize_t written = write(STDERR_FILENO, line, strlen(line));
+    (void)written;
+#endif
+}
+
+// GuardLine structure to represent a line of a guard report being put together on the stack; the
+// report is written from the fault handler, so it is formatted by hand rather than with snprintf
+struct GuardLine {
+    char text[256];
+    size_t length = 0;
+};
+
+// Function to append a string to a guard report line, cutting it off at the line's end
+void guard_append(GuardLine& line, const char* text) {
+    while (*text && line.length + 1 < sizeof(line.text)) {
+        line.text[line.length++] = *text++;
+    }
+    line.text[line.length] = '\0';
+}
+
+// Function to append a number to a guard report line, in decimal or as 0x-prefixed hex
+void guard_append_number(GuardLine& line, uintptr_t value, bool hex) {
+    char digits[2 * sizeof(uintptr_t) + 3];
+    char* end = digits + sizeof(digits) - 1;
+    char* begin = end;
+    *end = '\0';
+    do {
+        *--begin = "0123456789abcdef"[value % (hex ? 16 : 10)];
+        value /= hex ? 16 : 10;
+    } while (value);
+    if (hex) {
+        *--begin = 'x';
+        *--begin = '0';
+    }
+    guard_append(line, begin);
+}
+
+// Function to write a recorded stack to a guard report; outside the fault handler the frames are
+// symbolized where the platform can, and inside it they are written as bare return addresses
+void guard_report_stack(const char* title, void* const* frames, uint32_t depth, bool in_handler) {
+    if (!depth) {
+        return;
+    }
+    guard_report(title);
+#if !defined(_WIN32) && (defined(__GLIBC__) || defined(__APPLE__))
+    if (!in_handler) {
+        backtrace_symbols_fd(frames, static_cast<int>(depth), STDERR_FILENO);
+        return;
+    }
+#else
+    (void)in_handler;
+#endif
+    for (uint32_t i = 0; i < depth; ++i) {
+        GuardLine line;
+        guard_append(line, "    ");
+        guard_append_number(line, reinterpret_cast<uintptr_t>(frames[i]), true);
+        guard_append(line, "\n");
+        guard_report(line.text);
+    }
+}
+
+// Function to report what a bad access or free at address in the guard pool hit; what, if not given,
+// is worked out from the page the address lies in
+void guard_explain(const char* what, const void* address, bool in_handler) {
+    size_t page = (reinterpret_cast<uintptr_t>(address) - reinterpret_cast<uintptr_t>(guard_pool)) / os_page_size();
+    // a guard page is blamed on the slot before it, since allocations sit against their next guard
+    size_t index = page % 2 || page == 0 ? page / 2 : page / 2 - 1;
+    const GuardSlot& slot = guard_slots[index];
+
+    if (!what) {
+        what = page % 2 ? (slot.is_freed ? "use after free" : "bad access") : page ? "buffer overflow" : "buffer underflow";
+    }
+    GuardLine line;
+    guard_append(line, "guard: ");
+    guard_append(line, what);
+    guard_append(line, " at ");
+    guard_append_number(line, reinterpret_cast<uintptr_t>(address), true);
+    guard_append(line, "; slot ");
+    guard_append_number(line, index, false);
+    guard_append(line, " holds ");
+    guard_append_number(line, slot.size, false);
+    guard_append(line, " bytes at ");
+    guard_append_number(line, reinterpret_cast<uintptr_t>(slot.ptr), true);
+    guard_append(line, slot.is_freed ? ", freed\n" : "\n");
+    guard_report(line.text);
+    guard_report_stack("guard: allocated at\n", slot.alloc_stack, slot.alloc_depth, in_handler);
+    if (slot.is_freed) {
+        guard_report_stack("guard: freed at\n", slot.free_stack, slot.free_depth, in_handler);
+    }
+}
+
+// Function to check whether the calling thread's next mem_alloc should be sampled, given the sample
+// rate the caller loaded (never 0)
+bool guard_sample(uint32_t rate) {
+    if (tcache.guard_countdown > 1) {
+        --tcache.guard_countdown;
+        return false;
+    }
+    // A thread's first call only draws its first countdown, so allocations made at thread start-up
+    // aren't sampled every time
+    bool is_first = !tcache.guard_seed;
+    // the next sample is 1 to 2 * rate calls away, so regular allocation patterns can't dodge it
+    uint32_t seed = tcache.guard_seed ? tcache.guard_seed : static_cast<uint32_t>(reinterpret_cast<uintptr_t>(&tcache)) | 1;
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    tcache.guard_seed = seed;
+    tcache.guard_countdown = static_cast<uint32_t>(std::min<uint64_t>(1 + seed % (2 * uint64_t(rate)), UINT32_MAX));
+    return !is_first;
+}
+
+// Function to serve an allocation of at most a page from the guard pool, or nullptr if every slot
+// is busy or quarantined
+void* guard_alloc(size_t size) {
+    void* frames[GUARD_STACK_DEPTH];
+    uint32_t depth = guard_capture_stack(frames);
+
+    std::lock_guard<std::mutex> lock(guard_mutex);
+    if (!guard_queue_filled) {
+        for (uint32_t i = 0; i < GUARD_SLOT_COUNT; ++i) {
+            guard_queue[i] = i;
+        }
+        guard_queue_count = guard_pool_size ? GUARD_SLOT_COUNT : 0;
+        guard_queue_filled = true;
+    }
+    if (!guard_queue_count) {
+        return nullptr;
+    }
+    uint32_t index = guard_queue[guard_queue_head];
+    char* page = guard_pool + (2 * index + 1) * os_page_size();
+    if (!os_commit(page, os_page_size())) {
+        return nullptr;
+    }
+    guard_queue_head = (guard_queue_head + 1) % GUARD_SLOT_COUNT;
+    --guard_queue_count;
+
+    GuardSlot& slot = guard_slots[index];
+    slot.ptr = page + os_page_size() - size;
+    slot.size = size;
+    slot.is_freed = false;
+    slot.alloc_depth = depth;
+    std::copy(frames, frames + depth, slot.alloc_stack);
+    slot.free_depth = 0;
+    return slot.ptr;
+}
+
+// Function to get the slot a live guard allocation was served from, or nullptr for anything else
+GuardSlot* guard_slot_of(const void* ptr) {
+    size_t page = (reinterpret_cast<uintptr_t>(ptr) - reinterpret_cast<uintptr_t>(guard_pool)) / os_page_size();
+    GuardSlot* slot = page % 2 ? &guard_slots[page / 2] : nullptr;
+    return slot && slot->ptr == ptr && !slot->is_freed ? slot : nullptr;
+}
+
+// Function to free a guard allocation, quarantining its slot, and return its size; a double or stray
+// free in the pool is reported and aborts
+size_t guard_free(void* ptr) {
+    void* frames[GUARD_STACK_DEPTH];
+    uint32_t depth = guard_capture_stack(frames);
+
+    std::lock_guard<std::mutex> lock(guard_mutex);
+    GuardSlot* slot = guard_slot_of(ptr);
+    if (!slot) {
+        size_t page = (reinterpret_cast<uintptr_t>(ptr) - reinterpret_cast<uintptr_t>(guard_pool)) / os_page_size();
+        bool is_double = page % 2 && guard_slots[page / 2].ptr == ptr;
+        guard_explain(is_double ? "double free" : "invalid free", ptr, false);
+        guard_report_stack("guard: free called at\n", frames, depth, false);
+        abort();
+    }
+    os_protect(slot->ptr - (reinterpret_cast<uintptr_t>(slot->ptr) & (os_page_size() - 1)), os_page_size());
+    slot->is_freed = true;
+    slot->free_depth = depth;
+    std::copy(frames, frames + depth, slot->free_stack);
+    guard_queue[(guard_queue_head + guard_queue_count) % GUARD_SLOT_COUNT] = static_cast<uint32_t>(slot - guard_slots);
+    ++guard_queue_count;
+    return slot->size;
+}
+
+// Fault handler: faults in the guard pool are reported, then the previous handler is put back so the
+// access faults again and the process dies the way it would have
+#ifdef _WIN32
+LONG CALLBACK guard_fault_handler(EXCEPTION_POINTERS* info) {
+    if (info->ExceptionRecord->ExceptionCode == EXCEPTION_ACCESS_VIOLATION &&
+        guard_owns(reinterpret_cast<void*>(info->ExceptionRecord->ExceptionInformation[1]))) {
+        guard_explain(nullptr, reinterpret_cast<void*>(info->ExceptionRecord->ExceptionInformation[1]), true);
+    }
+    return EXCEPTION_CONTINUE_SEARCH;
+}
+#else
+struct sigaction guard_previous_action;
+
+void guard_fault_handler(int signal, siginfo_t* info, void*) {
+    if (guard_owns(info->si_addr)) {
+        guard_explain(nullptr, info->si_addr, true);
+    }
+    sigaction(signal, &guard_previous_action, nullptr);
+}
+#endif
+
+// Function to install the fault handler once
+void guard_install_handler() {
+    static std::once_flag installed;
+    std::call_once(installed, [] {
+#ifdef _WIN32
+        AddVectoredExceptionHandler(1, guard_fault_handler);
+#else
+        struct sigaction action = {};
+        action.sa_sigaction = guard_fault_handler;
+        action.sa_flags = SA_SIGINFO;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGSEGV, &action, &guard_previous_action);
+#endif
+    });
+}
+
+// Function to sample one in about rate mem_alloc calls into the guard pool (0 turns sampling off;
+// blocks already sampled stay guarded), recording the allocating and freeing stacks if asked
+void mem_guard_sample(uint32_t rate, bool record_stacks = false) {
+    guard_record_stacks = record_stacks;
+    if (rate) {
+        guard_install_handler();
+    }
+    guard_sample_rate = rate;
+}
+
+// Function to get the usable size of an allocation made through mem_*, or 0 for a pointer mem_free
+// would ignore
+size_t mem_usable_size(void* ptr) {
+    if (!ptr) {
+        return 0;
+    }
+    if (Slab* slab = slab_of(ptr)) {
+        return slab_owns(slab, ptr) ? slab->slot_size : 0;
+    }
+    if (guard_owns(ptr)) {
+        GuardSlot* slot = guard_slot_of(ptr);
+        return slot ? slot->size : 0;
+    }
+    BlockHeader* block = block_from_ptr(ptr);
+    if (!block || block->is_free) {
+        return 0;
+    }
+    return block->is_large ? large_mapping(block)->size : block->size;
+}
+
+// Function to get the usable size of a live slot or busy block as cheaply as possible, for the
+// statistics: a slot's offset is not checked, so a stray slab pointer is counted as a whole slot
+size_t ptr_usable_size(void* ptr) {
+    if (Slab* slab = slab_of(ptr)) {
+        return slab->slot_size;
+    }
+    if (guard_owns(ptr)) {
+        GuardSlot* slot = guard_slot_of(ptr);
+        return slot ? slot->size : 0;
+    }
+    BlockHeader* block = block_from_ptr(ptr);
+    if (!block || block->is_free) {
+        return 0;
+    }
+    return block->is_large ? large_mapping(block)->size : block->size;
+}
+
+// Function to get the size class a request is counted in
+int stats_class(size_t size) {
+    return size ? bit_fls(size) : 0;
+}
+
+// Function to count an allocation the calling thread made
+void stats_count_alloc(size_t size, void* ptr) {
+    if (ptr) {
+        ThreadStats& stats = thread_stats();
+        stats_add(stats.classes[stats_class(size)].allocs, 1);
+        stats_add(stats.bytes_in_use, ptr_usable_size(ptr));
+    }
+}
+
+// Function to count a free of usable bytes the calling thread made, as the free path resolved them
+// (0 for a pointer it ignored)
+void stats_count_free(size_t usable) {
+    if (usable) {
+        ThreadStats& stats = thread_stats();
+        stats_add(stats.classes[stats_class(usable)].frees, 1);
+        stats_sub(stats.bytes_in_use, usable);
+    }
+}
+
+// Function to allocate memory, without tracing the call
+void* mem_alloc_untraced(size_t size) {
+    if (size == 0 || size > MAX_ALLOC_SIZE) {
+        return nullptr;
+    }
+
+    size = std::max(align(size), MIN_BLOCK_SIZE);
+
+    // Loaded once: mem_guard_sample(0) may turn sampling off at any point
+    uint32_t rate = guard_sample_rate.load(std::memory_order_relaxed);
+    if (rate && guard_sample(rate) && size <= os_page_size()) {
+        if (void* ptr = guard_alloc(size)) {
+            return ptr;
+        }
+    }
+
+    if (size <= TCACHE_MAX_SIZE) {
+        TCacheBin& bin = tcache.bins[tcache_bin_for_request(size)];
+        if (!bin.head) {
+            tcache_refill(tcache_bin_for_request(size));
+        }
+        if (bin.head) {
+            return tcache_pop(bin);
+        }
+    }
+    if (is_large_size(size)) {
+        return large_alloc(size, ALIGNMENT);
+    }
+
+    return heap_alloc<RuntimeFit>(thread_heap(), size);
+}
+
+// Function to allocate zeroed memory for count elements of size bytes each, without tracing the call
+// Large mappings are taken fresh from the OS rather than from the spare, and arena pages committed for
+// the request are fresh too, so only small blocks and recycled arena pages get cleared
+void* mem_calloc_untraced(size_t count, size_t size) {
+    if (size != 0 && count > MAX_ALLOC_SIZE / size) {
+        return nullptr;
+    }
+    size_t total = count * size;
+    if (total == 0) {
+        return nullptr;
+    }
+
+    size = std::max(align(total), MIN_BLOCK_SIZE);
+
+    if (size <= TCACHE_MAX_SIZE) {
+        void* ptr = mem_alloc_untraced(total);
+        if (ptr) {
+            memset(ptr, 0, total);
+        }
+        return ptr;
+    }
+    if (is_large_size(size)) {
+        return large_alloc(size, ALIGNMENT, NODE_ANY, true);
+    }
+
+    return heap_calloc<RuntimeFit>(thread_heap(), size);
+}
+
+// Function to allocate memory placed on the given NUMA node, without tracing the call
+void* mem_alloc_on_node_untraced(size_t size, int node) {
+    if (node < 0 || node >= os_node_count() || size == 0 || size > MAX_ALLOC_SIZE) {
+        return nullptr;
+    }
+
+    size = std::max(align(size), MIN_BLOCK_SIZE);
+
+    if (is_large_size(size)) {
+        return large_alloc(size, ALIGNMENT, node);
+    }
+
+    NodeHeap& node_heap = node_heaps[node];
+    std::lock_guard<std::mutex> lock(node_heap.mutex);
+    if (!node_heap.heap) {
+        Heap* heap = new Heap();
+        heap->node = node;
+        heap->stand_in_lock = &node_heap.mutex;
+        std::lock_guard<std::mutex> list_lock(heap_list_mutex);
+        heap->next = heap_list;
+        heap_list = heap;
+        node_heap.heap = heap;
+    }
+    uint64_t epoch = scavenge_epoch.load(std::memory_order_relaxed);
+    if (node_heap.heap->scavenged_epoch.load(std::memory_order_relaxed) != epoch) {
+        heap_scavenge(node_heap.heap, epoch);
+    }
+    return heap_alloc<RuntimeFit>(node_heap.heap, size);
+}
+
+// Function to allocate memory whose address is a multiple of alignment, without tracing the call
+void* mem_alloc_aligned_untraced(size_t size, size_t alignment) {
+    if (alignment == 0 || (alignment & (alignment - 1)) || alignment > MAX_ALLOC_SIZE) {
+        return nullptr;
+    }
+    if (alignment <= ALIGNMENT) {
+        return mem_alloc_untraced(size);
+    }
+    if (size == 0 || size > MAX_ALLOC_SIZE) {
+        return nullptr;
+    }
+
+    size = std::max(align(size), MIN_BLOCK_SIZE);
+    if (is_large_size(size) && alignment <= os_page_size()) {
+        return large_alloc(size, alignment);
+    }
+    return heap_alloc_aligned<RuntimeFit>(thread_heap(), size, alignment);
+}
+
+// Function to free memory, without tracing the call; returns the usable size freed, or 0 if the pointer
+// was ignored
+size_t mem_free_untraced(void* ptr) {
+    if (!ptr) {
+        return 0;
+    }
+
+    size_t size;
+    BlockHeader* block = nullptr;
+    if (Slab* slab = slab_of(ptr)) {
+        if (!slab_owns(slab, ptr)) {
+            return 0;
+        }
+        size = slab->slot_size;
+    } else if (guard_owns(ptr)) {
+        return guard_free(ptr);
+    } else {
+        block = block_from_ptr(ptr);
+        if (!block || block->is_free) {
+            return 0;
+        }
+        if (block->is_large) {
+            size = large_mapping(block)->size;
+            large_free(block);
+            return size;
+        }
+        size = block->size;
+    }
+
+    // Node blocks go back to their node, since the thread cache would hand them to any allocation
+    if (size >= TCACHE_GRANULE && size <= TCACHE_MAX_SIZE && !(block && heap_is_node(block_arena(block)->heap))) {
+        tcache_free(ptr, size);
+        return size;
+    }
+
+    block_release(block);
+    return size;
+}
+
+// Function to free memory whose requested size the caller still knows; small blocks and slots go
+// straight to the thread cache without the checks mem_free makes (debug builds make them)
+void mem_free_sized(void* ptr, size_t size) {
+    if (!ptr) {
+        return;
+    }
+    if (trace_enabled.load(std::memory_order_relaxed)) {
+        trace_record(TRACE_FREE, 0, ptr, nullptr);
+    }
+
+    // No slot or block holds less than its rounded request, so the bin this picks is always safe
+    size = std::max(align(size), MIN_BLOCK_SIZE);
+    if (size > TCACHE_MAX_SIZE || guard_owns(ptr)) {
+        stats_count_free(mem_free_untraced(ptr));
+        return;
+    }
+    // Node blocks bypass the cache; the radix index tells them apart without reading the header
+    Region region = ptr_region(ptr);
+    if (region.kind == REGION_ARENA && heap_is_node(static_cast<Arena*>(region.descriptor)->heap)) {
+        stats_count_free(mem_free_untraced(ptr));
+        return;
+    }
+    // The statistics take off the slot's or block's own size, as the allocation added it; a block can be
+    // larger than its request (a remainder too small to split stays with it)
+    size_t usable;
+    if (Slab* slab = slab_of(ptr)) {
+        assert(slab_owns(slab, ptr) && slab->slot_size >= size);
+        usable = slab->slot_size;
+    } else {
+        assert(block_from_ptr(ptr) && !block_from_ptr(ptr)->is_free && !block_from_ptr(ptr)->is_large &&
+               block_from_ptr(ptr)->size >= size);
+        usable = (static_cast<BlockHeader*>(ptr) - 1)->size;
+    }
+    stats_count_free(usable);
+    tcache_free(ptr, size);
+}
+
+// Function to allocate count blocks of the same size into out, without tracing the calls
+size_t mem_alloc_batch_untraced(size_t size, size_t count, void** out) {
+    if (size == 0 || size > MAX_ALLOC_SIZE) {
+        return 0;
+    }
+
+    size = std::max(align(size), MIN_BLOCK_SIZE);
+    size_t done = 0;
+    if (is_large_size(size)) {
+        while (done < count && (out[done] = large_alloc(size, ALIGNMENT))) {
+            ++done;
+        }
+        return done;
+    }
+
+    Heap* heap = thread_heap();
+    heap_drain_remote(heap);
+    if (size <= SLAB_MAX_SIZE) {
+        while (done < count && (out[done] = slab_alloc(heap, size))) {
+            ++done;
+        }
+        return done;
+    }
+
+    size_t stride = sizeof(BlockHeader) + size;
+    while (done < count) {
+        size_t run = std::min(count - done, (MAX_BLOCK_SIZE + sizeof(BlockHeader)) / stride);
+        size_t want = run * stride - sizeof(BlockHeader);
+        BlockHeader* block = RuntimeFit::find(heap, want);
+        if (!block) {
+            Arena* new_arena = arena_create(heap, want + sizeof(BlockHeader));
+            if (!new_arena) {
+                break;
+            }
+            block = static_cast<BlockHeader*>(new_arena->base);
+        }
+        size_t carved = block_carve(block, size, run, out + done);
+        if (!carved) {
+            break;
+        }
+        done += carved;
+    }
+    return done;
+}
+
+// Function to allocate count blocks of the same size into out, carving each run from a single free
+// block; returns how many were allocated, which is count unless memory ran out
+size_t mem_alloc_batch(size_t size, size_t count, void** out) {
+    size_t done = mem_alloc_batch_untraced(size, count, out);
+    for (size_t i = 0; i < done; ++i) {
+        stats_count_alloc(size, out[i]);
+    }
+    if (trace_enabled.load(std::memory_order_relaxed)) {
+        for (size_t i = 0; i < done; ++i) {
+            trace_record(TRACE_ALLOC, size, out[i], nullptr);
+        }
+    }
+    return done;
+}
+
+// Pointers mem_free_batch sorts at a time, in a buffer of its own
+const size_t FREE_BATCH_CHUNK = 256;
+
+// Function to free count pointers at once; neighbouring blocks of the calling thread's heap are merged
+// with each other first, so each run of them is coalesced into the free lists only once (ptrs itself
+// is left as it was: it is sorted FREE_BATCH_CHUNK pointers at a time in a copy)
+void mem_free_batch(void** ptrs, size_t count) {
+    if (trace_enabled.load(std::memory_order_relaxed)) {
+        for (size_t i = 0; i < count; ++i) {
+            if (ptrs[i]) {
+                trace_record(TRACE_FREE, 0, ptrs[i], nullptr);
+            }
+        }
+    }
+    void* sorted[FREE_BATCH_CHUNK];
+    for (size_t done = 0; done < count; done += FREE_BATCH_CHUNK) {
+        size_t n = std::min(count - done, FREE_BATCH_CHUNK);
+        std::copy(ptrs + done, ptrs + done + n, sorted);
+        // std::less gives a total order even over pointers into unrelated blocks, where < does not
+        std::sort(sorted, sorted + n, std::less<void*>());
+        for (size_t i = 0; i < n; ++i) {
+            if (!sorted[i]) {
+                continue;
+            }
+            if (Slab* slab = slab_of(sorted[i])) {
+                if (slab_owns(slab, sorted[i])) {
+                    stats_count_free(slab->slot_size);
+                    ptr_release(sorted[i]);
+                }
+                continue;
+            }
+            if (guard_owns(sorted[i])) {
+                stats_count_free(guard_free(sorted[i]));
+                continue;
+            }
+
+            BlockHeader* block = block_from_ptr(sorted[i]);
+            if (!block || block->is_free) {
+                continue;
+            }
+            if (block->is_large) {
+                stats_count_free(large_mapping(block)->size);
+                large_free(block);
+                continue;
+            }
+            stats_count_free(block->size);
+            if (!tcache.heap || block_arena(block)->heap != tcache.heap) {
+                block_release(block);
+                continue;
+            }
+
+            while (i + 1 < n && !block->is_last && sorted[i + 1] == block_next(block) + 1 &&
+                   block_from_ptr(sorted[i + 1]) && !block_next(block)->is_free) {
+                stats_count_free(block_next(block)->size);
+                block_absorb(block, block_next(block));
+                ++i;
+            }
+            heap_free(block);
+        }
+    }
+}
+
+// Function to reallocate memory, without tracing the call
+void* mem_realloc_untraced(void* ptr, size_t size) {
+    if (!ptr) {
+        return mem_alloc_untraced(size);
+    }
+    if (size > MAX_ALLOC_SIZE) {
+        return nullptr;
+    }
+
+    size = std::max(align(size), MIN_BLOCK_SIZE);
+
+    if (Slab* slab = slab_of(ptr)) {
+        if (!slab_owns(slab, ptr)) {
+            return nullptr;
+        }
+        if (slab->slot_size >= size) {
+            return ptr;
+        }
+
+        void* new_ptr = mem_alloc_untraced(size);
+        if (!new_ptr) {
+            return nullptr;
+        }
+        memcpy(new_ptr, ptr, slab->slot_size);
+        mem_free_untraced(ptr);
+        return new_ptr;
+    }
+    if (guard_owns(ptr)) {
+        // Always moved, so a sampled block never outgrows its guard
+        GuardSlot* slot = guard_slot_of(ptr);
+        size_t old_size = slot ? slot->size : 0;
+        void* new_ptr = mem_alloc_untraced(size);
+        if (!new_ptr) {
+            return nullptr;
+        }
+        memcpy(new_ptr, ptr, std::min(old_size, size));
+        guard_free(ptr);
+        return new_ptr;
+    }
+
+    BlockHeader* block = block_from_ptr(ptr);
+    if (!block || block->is_free) {
+        return nullptr;
+    }
+
+    if (block->is_large) {
+        if (is_large_size(size)) {
+            if (void* moved = large_realloc(block, size)) {
+                return moved;
+            }
+        }
+    } else {
+        // Only the owner may touch the free lists a split or merge feeds; other threads keep the
+        // slack when shrinking and always move the data when growing
+        bool is_owner = block_arena(block)->heap == tcache.heap;
+        if (is_owner ? block_resize(block, size) : block->size >= size) {
+            return ptr;
+        }
+    }
+
+    void* new_ptr = mem_alloc_untraced(size);
+    if (!new_ptr) {
+        return nullptr;
+    }
+
+    size_t old_size = block->is_large ? large_mapping(block)->size : block->size;
+    memcpy(new_ptr, ptr, std::min(old_size, size));
+    mem_free_untraced(ptr);
+    return new_ptr;
+}
+
+// Function to allocate memory
+void* mem_alloc(size_t size) {
+    void* ptr = mem_alloc_untraced(size);
+    stats_count_alloc(size, ptr);
+    if (trace_enabled.load(std::memory_order_relaxed)) {
+        trace_record(TRACE_ALLOC, size, ptr, nullptr);
+    }
+    return ptr;
+}
+
+// Function to allocate zeroed memory for count elements of size bytes each (nullptr if count * size
+// overflows); traces record it as a plain allocation
+void* mem_calloc(size_t count, size_t size) {
+    void* ptr = mem_calloc_untraced(count, size);
+    stats_count_alloc(count * size, ptr);
+    if (trace_enabled.load(std::memory_order_relaxed)) {
+        trace_record(TRACE_ALLOC, count * size, ptr, nullptr);
+    }
+    return ptr;
+}
+
+// Function to allocate memory placed on the given NUMA node (below os_node_count(), else nullptr), for
+// buffers pinned to the threads of one node; mem_free takes it back as usual, while mem_realloc keeps
+// it on the node only while it can resize in place. Traces record it as a plain allocation
+void* mem_alloc_on_node(size_t size, int node) {
+    void* ptr = mem_alloc_on_node_untraced(size, node);
+    stats_count_alloc(size, ptr);
+    if (trace_enabled.load(std::memory_order_relaxed)) {
+        trace_record(TRACE_ALLOC, size, ptr, nullptr);
+    }
+    return ptr;
+}
+
+// Function to allocate memory whose address is a multiple of alignment (a power of two, e.g. 64 or 4096);
+// traces record it as a plain allocation
+void* mem_alloc_aligned(size_t size, size_t alignment) {
+    void* ptr = mem_alloc_aligned_untraced(size, alignment);
+    stats_count_alloc(size, ptr);
+    if (trace_enabled.load(std::memory_order_relaxed)) {
+        trace_record(TRACE_ALLOC, size, ptr, nullptr);
+    }
+    return ptr;
+}
+
+// Function to free memory
+void mem_free(void* ptr) {
+    // Recorded first, so the free is stamped before any reuse of the address by another thread
+    if (ptr && trace_enabled.load(std::memory_order_relaxed)) {
+        trace_record(TRACE_FREE, 0, ptr, nullptr);
+    }
+    stats_count_free(mem_free_untraced(ptr));
+}
+
+// Function to reallocate memory
+void* mem_realloc(void* ptr, size_t size) {
+    size_t old_usable = ptr ? ptr_usable_size(ptr) : 0;
+    void* new_ptr = mem_realloc_untraced(ptr, size);
+    if (!ptr) {
+        stats_count_alloc(size, new_ptr);
+    } else if (new_ptr) {
+        ThreadStats& stats = thread_stats();
+        ClassStats& counts = stats.classes[stats_class(size)];
+        stats_add(new_ptr == ptr ? counts.reallocs_in_place : counts.reallocs_copied, 1);
+        stats_add(stats.bytes_in_use, ptr_usable_size(new_ptr));
+        stats_sub(stats.bytes_in_use, old_usable);
+    }
+    if (trace_enabled.load(std::memory_order_relaxed)) {
+        trace_record(TRACE_REALLOC, size, ptr, new_ptr);
+    }
+    return new_ptr;
+}
+
+// Handles: an optional layer of relocatable allocations. A handle names an entry of a global table that
+// holds the allocation's current address; its block keeps the handle in a prefix and carries a cookie
+// of its own, so mem_compact can tell handle blocks apart and slide the unpinned ones down over the
+// free gaps in front of them. Pin a handle to get a pointer that stays valid until the matching unpin.
+// A handle carries its slot's generation next to the slot index, so one kept past its free is refused
+// rather than naming whatever allocation reuses the slot.
+
+using MemHandle = uint32_t;  // 0 is never a valid handle
+
+const uint32_t HANDLE_COOKIE = 0x48414E44;              // mixed into the cookie of a handle block
+const uint32_t HANDLE_MOVING = uint32_t(1) << 31;       // set in an entry's pins while it is moved or freed
+const uint32_t HANDLE_FREED = uint32_t(1) << 30;        // set in an entry's pins once freed while pinned
+const uint32_t HANDLE_PIN_MASK = HANDLE_FREED - 1;      // the pin count in an entry's pins
+const int HANDLE_INDEX_BITS = 20;                       // low bits of a handle holding its slot index
+const size_t HANDLE_TABLE_SIZE = size_t(1) << HANDLE_INDEX_BITS;  // entries the table can grow to
+const size_t COMPACT_VISIT_COST = 64;  // budget a compaction slice charges for each block it looks at
+
+// HandleEntry structure to represent one slot of the handle table
+struct HandleEntry {
+    std::atomic<void*> ptr{nullptr};  // the allocation's pinned pointer, nullptr while the slot is unused
+    std::atomic<uint32_t> pins{0};
+    std::atomic<uint32_t> generation{0};  // bumped each time the slot is freed, wrapping within a handle
+    uint32_t next_free = 0;           // next unused slot, 0 ending the list (guarded by handle_mutex)
+};
+
+// HandlePrefix structure stored at the start of a handle block, ahead of the caller's bytes; the link
+// word is left to the remote-free stack, so the handle stays readable while the block waits on it
+struct alignas(ALIGNMENT) HandlePrefix {
+    void* link;
+    MemHandle handle;
+};
+
+// Table reserved once and committed a page at a time as it grows; entry 0 stays unused
+HandleEntry* const handle_table =
+    static_cast<HandleEntry*>(os_reserve(HANDLE_TABLE_SIZE * sizeof(HandleEntry)));
+std::mutex handle_mutex;
+uint32_t handle_free_list = 0;
+size_t handle_committed = 0;
+std::atomic<uint32_t> handle_count{1};  // slots constructed so far
+
+// Function to get the cookie of a handle block
+uint32_t handle_cookie(const BlockHeader* block) {
+    return block_cookie(block) ^ HANDLE_COOKIE;
+}
+
+// Function to take an unused slot of the handle table, or 0 if the table is full
+uint32_t handle_acquire() {
+    std::lock_guard<std::mutex> lock(handle_mutex);
+    if (uint32_t handle = handle_free_list) {
+        handle_free_list = handle_table[handle].next_free;
+        return handle;
+    }
+
+    uint32_t handle = handle_count.load(std::memory_order_relaxed);
+    if (!handle_table || handle == HANDLE_TABLE_SIZE) {
+        return 0;
+    }
+    if ((handle + 1) * sizeof(HandleEntry) > handle_committed) {
+        if (!os_commit(reinterpret_cast<char*>(handle_table) + handle_committed, os_page_size())) {
+            return 0;
+        }
+        handle_committed += os_page_size();
+    }
+    new (&handle_table[handle]) HandleEntry();
+    handle_count.store(handle + 1, std::memory_order_release);
+    return handle;
+}
+
+// Function to return a slot to the handle table
+void handle_release(uint32_t handle) {
+    std::lock_guard<std::mutex> lock(handle_mutex);
+    handle_table[handle].next_free = handle_free_list;
+    handle_free_list = handle;
+}
+
+// Function to get the usable bytes of a handle block (the prefix included)
+size_t handle_block_size(BlockHeader* block) {
+    return block->is_large ? large_mapping(block)->size : block->size;
+}
+
+// Function to get the table slot a handle names, or nullptr if its index is out of range (whether the
+// handle is still current is for the caller to check, since the slot may be freed meanwhile)
+HandleEntry* handle_entry(MemHandle handle) {
+    uint32_t index = handle & (HANDLE_TABLE_SIZE - 1);
+    if (index == 0 || index >= handle_count.load(std::memory_order_acquire)) {
+        return nullptr;
+    }
+    return &handle_table[index];
+}
+
+// Function to check whether a handle is the live one of its slot
+bool handle_is_current(const HandleEntry& entry, MemHandle handle) {
+    return entry.generation.load(std::memory_order_relaxed) == handle >> HANDLE_INDEX_BITS &&
+           entry.ptr.load(std::memory_order_relaxed);
+}
+
+// Function to claim a handle slot for moving or freeing once no pin is held and no one else has it
+bool handle_try_lock(HandleEntry& entry) {
+    uint32_t expected = 0;
+    return entry.pins.compare_exchange_strong(expected, HANDLE_MOVING, std::memory_order_acquire);
+}
+
+// Function to lock the handle of a busy block for a move, or nullptr if the block belongs to no live,
+// unpinned handle (owner thread only)
+HandleEntry* handle_lock_block(BlockHeader* block) {
+    if (block->is_free || block->magic != handle_cookie(block)) {
+        return nullptr;
+    }
+    HandleEntry* slot = handle_entry(reinterpret_cast<HandlePrefix*>(block + 1)->handle);
+    if (!slot || !handle_try_lock(*slot)) {
+        return nullptr;
+    }
+    HandleEntry& entry = *slot;
+    // The slot may have been freed, and even reused, since the block was handed out
+    if (entry.ptr.load(std::memory_order_relaxed) != reinterpret_cast<char*>(block + 1) + sizeof(HandlePrefix)) {
+        entry.pins.fetch_and(~HANDLE_MOVING, std::memory_order_release);
+        return nullptr;
+    }
+    return &entry;
+}
+
+// Function to move a locked handle block down to the start of the free block in front of it, leaving
+// the free space behind it; returns false if the pages it moves into can't be committed
+bool block_slide(BlockHeader* gap, BlockHeader* block, HandleEntry& entry) {
+    Arena* arena = block_arena(block);
+    size_t size = block->size;
+    size_t gap_size = gap->size;
+    bool is_last = block->is_last;
+    char* payload = reinterpret_cast<char*>(gap + 1);
+    // the new home of the payload and the header and links of the free block that follows it
+    if (!arena_commit(arena, payload, payload + size + sizeof(BlockHeader) + MIN_BLOCK_SIZE)) {
+        return false;
+    }
+
+    free_list_remove(arena->heap, gap);
+    block->magic = 0;
+    memmove(payload, block + 1, size);
+    gap->size = size;
+    gap->is_free = false;
+    gap->magic = handle_cookie(gap);
+
+    BlockHeader* rest = block_next(gap);
+    rest->size = gap_size;
+    rest->prev_size = size;
+    block_set_arena(rest, arena);
+    rest->magic = block_cookie(rest);
+    rest->is_free = false;
+    rest->is_first = false;
+    rest->is_last = is_last;
+    rest->is_large = false;
+    if (!is_last) {
+        block_next(rest)->prev_size = gap_size;
+    }
+    if (arena->rover == block) {
+        arena->rover = gap;
+    }
+    if (arena->compact_cursor == block) {
+        arena->compact_cursor = gap;
+    }
+
+    entry.ptr.store(payload + sizeof(HandlePrefix), std::memory_order_relaxed);
+    entry.pins.fetch_and(~HANDLE_MOVING, std::memory_order_release);
+    heap_free(rest);
+    return true;
+}
+
+// Function to slide the unpinned handle blocks of an arena down over the free gaps in front of them
+// until spent reaches budget, each block looked at costing COMPACT_VISIT_COST and each move its size;
+// returns false if it stopped for the budget, leaving the arena's compact_cursor on the block the next
+// call resumes at (block_absorb and block_slide keep it on a header)
+bool arena_compact(Arena* arena, size_t budget, size_t& spent, size_t& moved) {
+    BlockHeader* block = arena->compact_cursor ? arena->compact_cursor : static_cast<BlockHeader*>(arena->base);
+    arena->compact_cursor = nullptr;
+    while (!block->is_last) {
+        if (spent >= budget && spent) {  // one block at least, so every slice gets somewhere
+            arena->compact_cursor = block;
+            return false;
+        }
+        spent += COMPACT_VISIT_COST;
+        BlockHeader* next_block = block_next(block);
+        if (block->is_free) {
+            if (HandleEntry* entry = handle_lock_block(next_block)) {
+                size_t size = next_block->size;
+                if (block_slide(block, next_block, *entry)) {
+                    spent += size;
+                    moved += size;
+                    continue;  // the block now in front of the gap is the one just moved
+                }
+                entry->pins.fetch_and(~HANDLE_MOVING, std::memory_order_release);
+            }
+        }
+        block = next_block;
+    }
+    return true;
+}
+
+// Function to allocate size relocatable bytes behind a handle, or 0 if they can't be had; handles are
+// left out of traces, since compaction moves their blocks
+MemHandle mem_handle_alloc(size_t size) {
+    if (size == 0 || size > MAX_ALLOC_SIZE) {
+        return 0;
+    }
+    uint32_t slot = handle_acquire();
+    if (!slot) {
+        return 0;
+    }
+    MemHandle handle = slot | handle_table[slot].generation.load(std::memory_order_relaxed) << HANDLE_INDEX_BITS;
+
+    size_t total = std::max(align(size), MIN_BLOCK_SIZE) + sizeof(HandlePrefix);
+    void* raw = is_large_size(total) ? large_alloc(total, ALIGNMENT) : heap_alloc<RuntimeFit>(thread_heap(), total);
+    if (!raw) {
+        handle_release(slot);
+        return 0;
+    }
+    BlockHeader* block = static_cast<BlockHeader*>(raw) - 1;
+    if (!block->is_large) {
+        block->magic = handle_cookie(block);
+    }
+    static_cast<HandlePrefix*>(raw)->handle = handle;
+
+    ThreadStats& stats = thread_stats();
+    stats_add(stats.classes[stats_class(size)].allocs, 1);
+    stats_add(stats.bytes_in_use, handle_block_size(block));
+    handle_table[slot].ptr.store(static_cast<char*>(raw) + sizeof(HandlePrefix), std::memory_order_release);
+    return handle;
+}
+
+// Function to free the bytes behind a handle slot locked for freeing, and the slot itself; pins taken
+// meanwhile are dropped again by their pinners, who find the handle stale
+void handle_destroy(HandleEntry& entry) {
+    char* raw = static_cast<char*>(entry.ptr.load(std::memory_order_relaxed)) - sizeof(HandlePrefix);
+    entry.ptr.store(nullptr, std::memory_order_relaxed);
+    entry.generation.store((entry.generation.load(std::memory_order_relaxed) + 1) &
+                           (~uint32_t(0) >> HANDLE_INDEX_BITS), std::memory_order_relaxed);
+    entry.pins.fetch_and(~(HANDLE_MOVING | HANDLE_FREED), std::memory_order_release);
+
+    BlockHeader* block = reinterpret_cast<BlockHeader*>(raw) - 1;
+    ThreadStats& stats = thread_stats();
+    stats_add(stats.classes[stats_class(handle_block_size(block) - sizeof(HandlePrefix))].frees, 1);
+    stats_sub(stats.bytes_in_use, handle_block_size(block));
+    if (block->is_large) {
+        large_free(block);
+    } else {
+        if (block_arena(block)->heap == tcache.heap) {
+            block->magic = block_cookie(block);
+        }
+        block_release(block);
+    }
+    handle_release(uint32_t(&entry - handle_table));
+}
+
+// Function to drop one pin of a slot (none is dropped if none is held); the last pin of a handle freed
+// while pinned frees it
+void handle_unpin_entry(HandleEntry& entry) {
+    uint32_t pins = entry.pins.load(std::memory_order_relaxed);
+    do {
+        if (!(pins & HANDLE_PIN_MASK)) {
+            return;
+        }
+    } while (!entry.pins.compare_exchange_weak(pins, pins - 1, std::memory_order_acq_rel, std::memory_order_relaxed));
+
+    pins -= 1;
+    if (pins == HANDLE_FREED && entry.pins.compare_exchange_strong(pins, HANDLE_MOVING, std::memory_order_acquire)) {
+        handle_destroy(entry);
+    }
+}
+
+// Function to pin a handle, getting the current address of its bytes; they stay put until the matching
+// mem_handle_unpin (pins nest, and any thread may hold them). Returns nullptr for a handle that names
+// no live allocation, or one already freed
+void* mem_handle_pin(MemHandle handle) {
+    HandleEntry* entry = handle_entry(handle);
+    if (!entry) {
+        return nullptr;
+    }
+    uint32_t pins = entry->pins.fetch_add(1, std::memory_order_acquire);
+    while (pins & HANDLE_MOVING) {
+        std::this_thread::yield();
+        pins = entry->pins.load(std::memory_order_acquire);
+    }
+    if ((pins & HANDLE_FREED) || !handle_is_current(*entry, handle)) {
+        handle_unpin_entry(*entry);
+        return nullptr;
+    }
+    return entry->ptr.load(std::memory_order_relaxed);
+}
+
+// Function to drop a pin taken with mem_handle_pin (a handle that names no live allocation is ignored)
+void mem_handle_unpin(MemHandle handle) {
+    HandleEntry* entry = handle_entry(handle);
+    if (entry && entry->generation.load(std::memory_order_relaxed) == handle >> HANDLE_INDEX_BITS) {
+        handle_unpin_entry(*entry);
+    }
+}
+
+// Function to free the bytes behind a handle and the handle itself (0 is ignored); a pinned handle is
+// freed by its last unpin. Returns false if the handle names no live allocation
+bool mem_handle_free(MemHandle handle) {
+    if (!handle) {
+        return true;
+    }
+    HandleEntry* entry = handle_entry(handle);
+    if (!entry) {
+        return false;
+    }
+    uint32_t pins = entry->pins.load(std::memory_order_relaxed);
+    for (;;) {
+        // wait out a move in progress
+        if (pins & HANDLE_MOVING) {
+            std::this_thread::yield();
+            pins = entry->pins.load(std::memory_order_relaxed);
+            continue;
+        }
+        if ((pins & HANDLE_FREED) || !handle_is_current(*entry, handle)) {
+            return false;
+        }
+        if (entry->pins.compare_exchange_weak(pins, pins ? pins | HANDLE_FREED : HANDLE_MOVING,
+                                              std::memory_order_acquire, std::memory_order_relaxed)) {
+            break;
+        }
+    }
+    if (pins) {
+        return true;
+    }
+    // The slot may have been freed, and even reused, by a racing free since it was checked
+    if (!handle_is_current(*entry, handle)) {
+        entry->pins.fetch_and(~HANDLE_MOVING, std::memory_order_release);
+        return false;
+    }
+    handle_destroy(*entry);
+    return true;
+}
+
+// Function to run one slice of compaction over the calling thread's heap: unpinned handle blocks slide
+// down over the free gaps in front of them, so the free space gathers in one block at each arena's
+// tail (whose pages are decommitted as usual). A slice stops once about budget bytes have been moved or
+// walked over (COMPACT_VISIT_COST a block), so its time is bounded however many blocks there are, and
+// adds the bytes it moved to *moved_bytes if given; returns whether it finished the pass over the heap, so
+// calls until one returns true compact it, each resuming where the last stopped
+bool mem_compact(size_t budget, size_t* moved_bytes = nullptr) {
+    Heap* heap = thread_heap();
+    heap_drain_remote(heap);
+
+    size_t spent = 0;
+    size_t moved = 0;
+    // A pass goes down the arena list once; arenas added at its head meanwhile wait for the next pass
+    Arena* arena = heap->compact_rover ? heap->compact_rover : heap->arena_list;
+    while (arena && arena_compact(arena, budget, spent, moved)) {
+        arena = arena->next;
+    }
+    heap->compact_rover = arena;
+    if (moved_bytes) {
+        *moved_bytes += moved;
+    }
+    return !arena;
+}
+
+// Usable bytes in each chunk of a scope, unless a single request needs more
+const size_t SCOPE_CHUNK_SIZE = 1 << 20;
+// Bytes a scope commits ahead of its cursor at a time
+const size_t SCOPE_COMMIT_STEP = 64 << 10;
+
+// Scope structure to represent a region whose allocations are pointer bumps, without headers, through
+// a chain of arenas that belongs to no heap; one reset reclaims all of them at once
+struct Scope {
+    Arena* chunks = nullptr;  // SCOPE_CHUNK_SIZE chunks, newest first, linked through Arena::next
+    Arena* oversized = nullptr;  // chunks of one request each that a SCOPE_CHUNK_SIZE chunk can't hold
+    char* cursor = nullptr;   // next free byte of the newest chunk
+    char* limit = nullptr;    // end of the newest chunk
+};
+
+// Function to continue a scope in a fresh chunk
+bool scope_grow(Scope* scope) {
+    Arena* chunk = arena_reserve(nullptr, SCOPE_CHUNK_SIZE, 0, thread_node());
+    if (!chunk) {
+        return false;
+    }
+    chunk->next = scope->chunks;
+    scope->chunks = chunk;
+    scope->cursor = static_cast<char*>(chunk->base);
+    scope->limit = scope->cursor + chunk->size;
+    return true;
+}
+
+// Function to create an empty scope
+Scope* mem_scope_begin() {
+    return new Scope();
+}
+
+// Function to allocate memory from a scope; it lives until the scope is reset and must never be
+// passed to mem_free or mem_realloc
+void* mem_scope_alloc(Scope* scope, size_t size) {
+    if (size == 0 || size > MAX_ALLOC_SIZE) {
+        return nullptr;
+    }
+    size = align(size);
+    if (size > SCOPE_CHUNK_SIZE) {
+        // A request no chunk can hold gets a chunk of its own, leaving the cursor where it is
+        Arena* chunk = arena_reserve(nullptr, size, size, thread_node());
+        if (!chunk) {
+            return nullptr;
+        }
+        chunk->next = scope->oversized;
+        scope->oversized = chunk;
+        return chunk->base;
+    }
+    if (static_cast<size_t>(scope->limit - scope->cursor) < size && !scope_grow(scope)) {
+        return nullptr;
+    }
+
+    // A chunk is only ever committed as a prefix, which its committed_bytes measures
+    char* ptr = scope->cursor;
+    char* committed = reinterpret_cast<char*>(scope->chunks) + scope->chunks->committed_bytes;
+    if (ptr + size > committed &&
+        !arena_commit(scope->chunks, committed, std::min(scope->limit, std::max(ptr + size, committed + SCOPE_COMMIT_STEP)))) {
+        return nullptr;
+    }
+    scope->cursor = ptr + size;
+    return ptr;
+}
+
+// Function to reclaim everything allocated from a scope at once; the oldest SCOPE_CHUNK_SIZE chunk stays,
+// still committed, for the scope's next use, and oversized chunks are released
+void mem_scope_reset(Scope* scope) {
+    while (scope->oversized) {
+        Arena* chunk = scope->oversized;
+        scope->oversized = chunk->next;
+        arena_unmap(chunk);
+    }
+    if (!scope->chunks) {
+        return;
+    }
+    while (scope->chunks->next) {
+        Arena* chunk = scope->chunks;
+        scope->chunks = chunk->next;
+        arena_unmap(chunk);
+    }
+    scope->cursor = static_cast<char*>(scope->chunks->base);
+    scope->limit = scope->cursor + scope->chunks->size;
+}
+
+// Function to reclaim everything allocated from a scope and destroy the scope
+void mem_scope_end(Scope* scope) {
+    mem_scope_reset(scope);
+    if (scope->chunks) {
+        arena_unmap(scope->chunks);
+    }
+    delete scope;
+}
+
+// Function to display the memory layout of every heap (other threads must not be allocating meanwhile)
+void mem_show() {
+    std::lock_guard<std::mutex> lock(heap_list_mutex);
+    for (Heap* heap = heap_list; heap; heap = heap->next) {
+        for (Arena* arena = heap->arena_list; arena; arena = arena->next) {
+            std::cout << "Arena (" << arena->size << "b, " << arena->committed_bytes << "b committed"
+                      << (arena->is_large_pages ? ", large pages" : "");
+            if (arena->node != NODE_ANY) {
+                std::cout << ", node " << arena->node;
+            }
+            std::cout << ")" << std::endl;
+            char* base = static_cast<char*>(arena->base);
+            while (reinterpret_cast<size_t>(base) < reinterpret_cast<size_t>(arena->base) + arena->size) {
+                BlockHeader* block = reinterpret_cast<BlockHeader*>(base);
+                std::cout << (block->is_free ? "*" : " ") << " Block at " << reinterpret_cast<void*>(base)
+                          << " -> Size: " << block->size
+                          << ", Busy: " << (block->is_free ? "No" : "Yes")
+                          << ", First: " << (block->is_first ? "Yes" : "No")
+                          << ", Last: " << (block->is_last ? "Yes" : "No") << std::endl;
+                base += sizeof(BlockHeader) + block->size;
+            }
+        }
+    }
+    for (size_t offset = 0; offset < std::min(slab_zone_used.load(), slab_zone_size); offset += SLAB_SIZE) {
+        Slab* slab = reinterpret_cast<Slab*>(slab_zone + offset);
+        if (slab->slot_size) {
+            std::cout << "Slab at " << static_cast<void*>(slab) << " -> Slot size: " << slab->slot_size
+                      << ", Free: " << slab->free_count << "/" << slab->slot_count << std::endl;
+        }
+    }
+    std::cout << "----------" << std::endl;
+}
+
+// MemStats structure to represent a snapshot of the allocator's counters, summed over every thread
+struct MemStats {
+    size_t bytes_in_use;        // usable bytes of live allocations made through mem_*
+    size_t committed;           // bytes backed by memory, arena and slab metadata included
+    size_t reserved;            // address space held
+    size_t arenas;              // arena mappings, scope chunks included
+    size_t free_blocks;         // blocks on heap free lists
+    size_t free_bytes;          // and their payload bytes
+    size_t largest_free_block;  // in the calling thread's heap
+    double fragmentation;       // of the calling thread's heap: free bytes outside its largest free block
+    struct {
+        uint64_t allocs;
+        uint64_t frees;
+        uint64_t reallocs_in_place;
+        uint64_t reallocs_copied;
+    } classes[STATS_CLASS_COUNT];  // class n counts requests of [2^n, 2^(n+1)) bytes
+};
+
+// Function to take a snapshot of the counters without stopping other threads; each counter is exact
+// but they are read one after another, so they may be a few calls apart
+MemStats mem_stats() {
+    MemStats result = {};
+    {
+        std::lock_guard<std::mutex> lock(stats_list_mutex);
+        for (ThreadStats* stats = stats_list; stats; stats = stats->next) {
+            result.bytes_in_use += stats->bytes_in_use.load(std::memory_order_relaxed);
+            result.committed += stats->committed.load(std::memory_order_relaxed);
+            result.reserved += stats->reserved.load(std::memory_order_relaxed);
+            result.arenas += stats->arenas.load(std::memory_order_relaxed);
+            result.free_blocks += stats->free_blocks.load(std::memory_order_relaxed);
+            result.free_bytes += stats->free_bytes.load(std::memory_order_relaxed);
+            for (int i = 0; i < STATS_CLASS_COUNT; ++i) {
+                result.classes[i].allocs += stats->classes[i].allocs.load(std::memory_order_relaxed);
+                result.classes[i].frees += stats->classes[i].frees.load(std::memory_order_relaxed);
+                result.classes[i].reallocs_in_place += stats->classes[i].reallocs_in_place.load(std::memory_order_relaxed);
+                result.classes[i].reallocs_copied += stats->classes[i].reallocs_copied.load(std::memory_order_relaxed);
+            }
+        }
+    }
+    // Other heaps' free lists may be changing under us; only our own can be walked safely
+    if (tcache.heap) {
+        result.largest_free_block = heap_largest_free(tcache.heap);
+        result.fragmentation = heap_fragmentation(tcache.heap);
+    }
+    return result;
+}
+
+// Function to write a snapshot of the counters in the Prometheus text format, for a metrics scraper
+void mem_stats_export(std::ostream& out) {
+    MemStats stats = mem_stats();
+    out << "mem_bytes_in_use " << stats.bytes_in_use << "\n"
+        << "mem_committed_bytes " << stats.committed << "\n"
+        << "mem_reserved_bytes " << stats.reserved << "\n"
+        << "mem_arenas " << stats.arenas << "\n"
+        << "mem_free_blocks " << stats.free_blocks << "\n"
+        << "mem_free_bytes " << stats.free_bytes << "\n"
+        << "mem_largest_free_block_bytes " << stats.largest_free_block << "\n"
+        << "mem_fragmentation_ratio " << stats.fragmentation << "\n";
+    for (int i = 0; i < STATS_CLASS_COUNT; ++i) {
+        const auto& counts = stats.classes[i];
+        if (!counts.allocs && !counts.frees && !counts.reallocs_in_place && !counts.reallocs_copied) {
+            continue;
+        }
+        std::string label = "{size_class=\"" + std::to_string(uint64_t(1) << i) + "\"} ";
+        out << "mem_allocs_total" << label << counts.allocs << "\n"
+            << "mem_frees_total" << label << counts.frees << "\n"
+            << "mem_reallocs_in_place_total" << label << counts.reallocs_in_place << "\n"
+            << "mem_reallocs_copied_total" << label << counts.reallocs_copied << "\n";
+    }
+}
+
+// NoLock structure to represent the locking policy of an allocator used by a single thread
+struct NoLock {
+    void lock() {}
+    void unlock() {}
+    std::mutex* stand_in() { return nullptr; }  // the scavenger cannot act for such a heap
+};
+
+// MutexLock structure to represent the locking policy of an allocator shared between threads
+struct MutexLock {
+    std::mutex mutex;
+
+    void lock() { mutex.lock(); }
+    void unlock() { mutex.unlock(); }
+    std::mutex* stand_in() { return &mutex; }
+};
+
+// Allocator class to represent an independent heap with its fit strategy, payload alignment and
+// locking fixed at compile time; it shares the arena, slab and large-mapping machinery of the
+// mem_* functions but not their per-thread heaps or caches. The header layout is shared by every
+// heap, so it stays a build option (BLOCK_HEADER_WIDE). Everything allocated from an instance must
+// be freed through it, and before the instance is destroyed (mem_free would park small pointers in
+// the calling thread's cache, past the instance's lifetime). The heap hands its work to the scavenger
+// at its allocations; with a real lock the scavenger also takes the lock to do it while the heap is idle.
+template <typename FitPolicy = GoodFit, size_t Alignment = ALIGNMENT, typename LockPolicy = NoLock>
+class Allocator {
+    static_assert(Alignment >= ALIGNMENT && (Alignment & (Alignment - 1)) == 0,
+                  "Alignment must be a power of two no smaller than ALIGNMENT");
+
+public:
+    Allocator() {
+        if ((heap.stand_in_lock = lock.stand_in())) {
+            std::lock_guard<std::mutex> list_lock(heap_list_mutex);
+            heap.next = heap_list;
+            heap_list = &heap;
+        }
+    }
+    Allocator(const Allocator&) = delete;
+    Allocator& operator=(const Allocator&) = delete;
+
+    ~Allocator() {
+        if (heap.stand_in_lock) {
+            std::lock_guard<std::mutex> list_lock(heap_list_mutex);
+            Heap** link = &heap_list;
+            while (*link != &heap) {
+                link = &(*link)->next;
+            }
+            *link = heap.next;
+        }
+        // Blocks the scavenger holds come back through the scavenged_free stack
+        scavenge_drain();
+        heap_drain_remote(&heap);
+        heap_drain_scavenged(&heap, SIZE_MAX);
+        // The free lists go with the arenas
+        ThreadStats& stats = thread_stats();
+        stats_sub(stats.free_blocks, heap.free_blocks);
+        stats_sub(stats.free_bytes, heap.free_bytes);
+        while (Arena* arena = heap.arena_list) {
+            heap.arena_list = arena->next;
+            arena_unmap(arena);
+        }
+        for (Slab*& head : heap.slabs) {
+            while (Slab* slab = head) {
+                head = slab->next;
+                slab_chunk_release(slab);
+            }
+        }
+    }
+
+    // Function to allocate memory from this heap
+    void* mem_alloc(size_t size) {
+        if (size == 0 || size > MAX_ALLOC_SIZE) {
+            return nullptr;
+        }
+        std::lock_guard<LockPolicy> guard(lock);
+        return alloc(std::max(align(size), MIN_BLOCK_SIZE));
+    }
+
+    // Function to get the external fragmentation of this heap's arenas
+    double fragmentation() {
+        std::lock_guard<LockPolicy> guard(lock);
+        return heap_fragmentation(&heap);
+    }
+
+    // Function to free memory allocated from this heap
+    void mem_free(void* ptr) {
+        if (!ptr) {
+            return;
+        }
+        std::lock_guard<LockPolicy> guard(lock);
+        release(ptr);
+    }
+
+    // Function to reallocate memory allocated from this heap
+    void* mem_realloc(void* ptr, size_t size) {
+        if (!ptr) {
+            return mem_alloc(size);
+        }
+        if (size > MAX_ALLOC_SIZE) {
+            return nullptr;
+        }
+        size = std::max(align(size), MIN_BLOCK_SIZE);
+
+        std::lock_guard<LockPolicy> guard(lock);
+        size_t old_size;
+        if (Slab* slab = slab_of(ptr)) {
+            if (!slab_owns(slab, ptr)) {
+                return nullptr;
+            }
+            if (slab->slot_size >= size) {
+                return ptr;
+            }
+            old_size = slab->slot_size;
+        } else {
+            BlockHeader* block = block_from_ptr(ptr);
+            if (!block || block->is_free) {
+                return nullptr;
+            }
+            if (block->is_large) {
+                if (is_large_size(size)) {
+                    if (void* moved = large_realloc(block, size)) {
+                        return moved;
+                    }
+                }
+                old_size = large_mapping(block)->size;
+            } else {
+                if (block_arena(block)->heap == &heap ? block_resize(block, size) : block->size >= size) {
+                    return ptr;
+                }
+                old_size = block->size;
+            }
+        }
+
+        void* new_ptr = alloc(size);
+        if (!new_ptr) {
+            return nullptr;
+        }
+        memcpy(new_ptr, ptr, std::min(old_size, size));
+        release(ptr);
+        return new_ptr;
+    }
+
+private:
+    // Function to allocate an aligned, rounded size with the lock held
+    void* alloc(size_t size) {
+        uint64_t epoch = scavenge_epoch.load(std::memory_order_relaxed);
+        if (heap.scavenged_epoch.load(std::memory_order_relaxed) != epoch) {
+            heap_scavenge(&heap, epoch);
+        }
+        if (Alignment == ALIGNMENT && size <= SLAB_MAX_SIZE) {
+            heap_drain_remote(&heap);
+            if (void* ptr = slab_alloc(&heap, size)) {
+                return ptr;
+            }
+        }
+        if (is_large_size(size) && Alignment <= os_page_size()) {
+            return large_alloc(size, Alignment);
+        }
+        if (Alignment == ALIGNMENT) {
+            return heap_alloc<FitPolicy>(&heap, size);
+        }
+        return heap_alloc_aligned<FitPolicy>(&heap, size, Alignment);
+    }
+
+    // Function to free a slot or block with the lock held, handing foreign ones to their owner heap
+    void release(void* ptr) {
+        if (Slab* slab = slab_of(ptr)) {
+            if (!slab_owns(slab, ptr)) {
+                return;
+            }
+            if (slab->heap == &heap) {
+                slab_free(slab, ptr);
+            } else {
+                ptr_release(ptr);
+            }
+            return;
+        }
+
+        BlockHeader* block = block_from_ptr(ptr);
+        if (!block || block->is_free) {
+            return;
+        }
+        if (block->is_large) {
+            large_free(block);
+        } else if (block_arena(block)->heap == &heap) {
+            heap_free(block);
+        } else {
+            block_release(block);
+        }
+    }
+
+    Heap heap;
+    LockPolicy lock;
+};
+
+// Allocator for a single-threaded embedded build: one heap, no locking
+using EmbeddedAllocator = Allocator<GoodFit, ALIGNMENT, NoLock>;
+
+// Allocator for a heap shared by server threads, with cache-line aligned payloads
+using SharedAllocator = Allocator<GoodFit, 64, MutexLock>;
+
+// Function to allocate memory for the standard library adapters, which must throw when out of memory
+void* mem_alloc_or_throw(size_t size, size_t alignment) {
+    void* ptr = mem_alloc_aligned(std::max(size, size_t(1)), std::max(alignment, ALIGNMENT));
+    if (!ptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+// MemResource class to represent a std::pmr::memory_resource backed by the mem_* functions, so pmr
+// containers allocate from the calling thread's heap
+class MemResource : public std::pmr::memory_resource {
+protected:
+    void* do_allocate(size_t bytes, size_t alignment) override {
+        return mem_alloc_or_throw(bytes, alignment);
+    }
+
+    void do_deallocate(void* ptr, size_t bytes, size_t) override {
+        mem_free_sized(ptr, std::max(bytes, size_t(1)));
+    }
+
+    // Every MemResource draws from the same heaps, so memory from one may be returned to another
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+        return dynamic_cast<const MemResource*>(&other) != nullptr;
+    }
+};
+
+// Function to get the shared MemResource, e.g. to hand to std::pmr containers
+MemResource* mem_resource() {
+    static MemResource resource;
+    return &resource;
+}
+
+// StlAllocator structure to represent a standard allocator backed by the mem_* functions, for
+// containers that take an allocator type rather than a memory resource
+template <typename T>
+struct StlAllocator {
+    using value_type = T;
+
+    StlAllocator() noexcept = default;
+
+    template <typename U>
+    StlAllocator(const StlAllocator<U>&) noexcept {}
+
+    T* allocate(size_t count) {
+        if (count > MAX_ALLOC_SIZE / sizeof(T)) {
+            throw std::bad_array_new_length();
+        }
+        return static_cast<T*>(mem_alloc_or_throw(count * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T* ptr, size_t count) noexcept {
+        mem_free_sized(ptr, std::max(count * sizeof(T), size_t(1)));
+    }
+};
+
+// Function to compare standard allocators; they are all interchangeable
+template <typename T, typename U>
+bool operator==(const StlAllocator<T>&, const StlAllocator<U>&) noexcept {
+    return true;
+}
+
+// Function to compare standard allocators; they are all interchangeable
+template <typename T, typename U>
+bool operator!=(const StlAllocator<T>&, const StlAllocator<U>&) noexcept {
+    return false;
+}
+
+// Checksums work in 32-byte chunks of four 8-byte words. Each word's byte sum k goes into a_k and
+// the running a_k into b_k after every chunk (Fletcher-style), so a word that moves, vanishes or
+// changes alters the result. Every kernel computes exactly the same value.
+const size_t CHECKSUM_CHUNK = 32;
+
+// ChecksumState structure to represent the per-word sums of a checksum in progress
+struct ChecksumState {
+    uint64_t a[4] = {};
+    uint64_t b[4] = {};
+};
+
+// Function to add whole chunks to a checksum, a word's byte sum at a time where no SIMD is available
+void checksum_chunks_scalar(ChecksumState& state, const uint8_t* bytes, size_t chunks) {
+    const uint64_t low_bytes = 0x00FF00FF00FF00FFull;
+    for (size_t i = 0; i < chunks; ++i, bytes += CHECKSUM_CHUNK) {
+        for (int k = 0; k < 4; ++k) {
+            uint64_t word;
+            memcpy(&word, bytes + 8 * k, sizeof(word));
+            uint64_t pairs = (word & low_bytes) + ((word >> 8) & low_bytes);
+            state.a[k] += (pairs * 0x0001000100010001ull) >> 48;
+            state.b[k] += state.a[k];
+        }
+    }
+}
+
+#if defined(__SSE2__) || defined(_M_X64)
+// Function to add whole chunks to a checksum with SSE2, whose sum of absolute differences against
+// zero gives the byte sums of two words at once
+void checksum_chunks_sse2(ChecksumState& state, const uint8_t* bytes, size_t chunks) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i a01 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(state.a));
+    __m128i a23 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(state.a + 2));
+    __m128i b01 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(state.b));
+    __m128i b23 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(state.b + 2));
+    for (size_t i = 0; i < chunks; ++i, bytes += CHECKSUM_CHUNK) {
+        a01 = _mm_add_epi64(a01, _mm_sad_epu8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(bytes)), zero));
+        a23 = _mm_add_epi64(a23, _mm_sad_epu8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(bytes + 16)), zero));
+        b01 = _mm_add_epi64(b01, a01);
+        b23 = _mm_add_epi64(b23, a23);
+    }
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(state.a), a01);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(state.a + 2), a23);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(state.b), b01);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(state.b + 2), b23);
+}
+#endif
+
+#ifdef __AVX2__
+// Function to add whole chunks to a checksum with AVX2, a chunk per load
+void checksum_chunks_avx2(ChecksumState& state, const uint8_t* bytes, size_t chunks) {
+    __m256i zero = _mm256_setzero_si256();
+    __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(state.a));
+    __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(state.b));
+    for (size_t i = 0; i < chunks; ++i, bytes += CHECKSUM_CHUNK) {
+        a = _mm256_add_epi64(a, _mm256_sad_epu8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(bytes)), zero));
+        b = _mm256_add_epi64(b, a);
+    }
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(state.a), a);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(state.b), b);
+}
+#endif
+
+// Function to calculate checksum, with the widest kernel the build targets (AVX2 needs -mavx2 or /arch:AVX2)
+uint64_t checksum(const void* data, size_t size) {
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    ChecksumState state;
+    size_t chunks = size / CHECKSUM_CHUNK;
+#ifdef __AVX2__
+    checksum_chunks_avx2(state, bytes, chunks);
+#elif defined(__SSE2__) || defined(_M_X64)
+    checksum_chunks_sse2(state, bytes, chunks);
+#else
+    checksum_chunks_scalar(state, bytes, chunks);
+#endif
+
+    // The tail is summed as a last chunk padded with zeros, and the size is mixed in so that losing
+    // trailing zeros shows too
+    if (size_t tail = size % CHECKSUM_CHUNK) {
+        uint8_t last[CHECKSUM_CHUNK] = {};
+        memcpy(last, bytes + chunks * CHECKSUM_CHUNK, tail);
+        checksum_chunks_scalar(state, last, 1);
+    }
+    uint64_t result = size;
+    for (int k = 0; k < 4; ++k) {
+        result = (result ^ state.a[k]) * 0x100000001B3ull;
+        result = (result ^ state.b[k]) * 0x100000001B3ull;
+    }
+    return result;
+}
+
+// Function to advance a wyrand generator, returning 8 well-mixed random bytes
+uint64_t wyrand(uint64_t& state) {
+    state += 0xA0761D6478BD642Full;
+#ifdef _MSC_VER
+    uint64_t high;
+    uint64_t low = _umul128(state, state ^ 0xE7037ED1A0B428DBull, &high);
+    return low ^ high;
+#else
+    __uint128_t product = static_cast<__uint128_t>(state) * (state ^ 0xE7037ED1A0B428DBull);
+    return static_cast<uint64_t>(product) ^ static_cast<uint64_t>(product >> 64);
+#endif
+}
+
+// Function to fill data with random values, 8 bytes per step of the generator
+void random_input(void* data, size_t size, uint64_t& state) {
+    uint8_t* bytes = static_cast<uint8_t*>(data);
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word = wyrand(state);
+        memcpy(bytes + i, &word, sizeof(word));
+    }
+    if (i < size) {
+        uint64_t word = wyrand(state);
+        memcpy(bytes + i, &word, size - i);
+    }
+}
+
+// MemApi structure to represent the allocator under test in the benchmarks
+struct MemApi {
+    static const char* name() { return "mem_alloc"; }
+    static void* alloc(size_t size) { return mem_alloc(size); }
+    static void* resize(void* ptr, size_t size) { return mem_realloc(ptr, size); }
+    static void release(void* ptr) { mem_free(ptr); }
+};
+
+// MallocApi structure to represent the C runtime heap as a benchmark baseline
+struct MallocApi {
+    static const char* name() { return "malloc"; }
+    static void* alloc(size_t size) { return std::malloc(size); }
+    static void* resize(void* ptr, size_t size) { return std::realloc(ptr, size); }
+    static void release(void* ptr) { std::free(ptr); }
+};
+
+#ifdef _WIN32
+// HeapApi structure to represent the Windows process heap as a benchmark baseline
+struct HeapApi {
+    static const char* name() { return "HeapAlloc"; }
+    static void* alloc(size_t size) { return HeapAlloc(GetProcessHeap(), 0, size); }
+    static void* resize(void* ptr, size_t size) { return HeapReAlloc(GetProcessHeap(), 0, ptr, size); }
+    static void release(void* ptr) { HeapFree(GetProcessHeap(), 0, ptr); }
+};
+#endif
+
+using BenchClock = std::chrono::steady_clock;
+
+// LatencyLog structure to represent the latencies of one kind of operation over a benchmark run;
+// every sample slot is written up front, so recording neither allocates nor faults in pages that the
+// committed-memory probe would count against the allocator
+struct LatencyLog {
+    std::vector<uint32_t> samples;
+    size_t count = 0;
+
+    void record(BenchClock::time_point start, BenchClock::time_point stop) {
+        if (count < samples.size()) {
+            samples[count++] = static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    stop - start).count());
+        }
+    }
+};
+
+// BenchResult structure to represent what one benchmark run measured
+struct BenchResult {
+    size_t operations = 0;
+    double seconds = 0;
+    size_t peak_committed = 0;  // growth of the process's committed memory over the run
+    LatencyLog alloc_latency;
+    LatencyLog free_latency;
+    LatencyLog realloc_latency;
+
+    explicit BenchResult(size_t capacity) {
+        alloc_latency.samples.resize(capacity);
+        free_latency.samples.resize(capacity);
+        realloc_latency.samples.resize(capacity);
+    }
+};
+
+// Function to get the memory the process has committed, as the OS accounts it
+size_t process_committed_bytes() {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+        return 0;
+    }
+    return counters.PagefileUsage;
+#else
+    // Resident pages, the closest POSIX measure of memory actually backing the process
+    size_t pages = 0;
+    size_t resident = 0;
+    if (FILE* statm = fopen("/proc/self/statm", "r")) {
+        if (fscanf(statm, "%zu %zu", &pages, &resident) != 2) {
+            resident = 0;
+        }
+        fclose(statm);
+    }
+    return resident * os_page_size();
+#endif
+}
+
+// CommitProbe structure to represent the high-water mark of committed memory during a benchmark
+struct CommitProbe {
+    size_t start = process_committed_bytes();
+    size_t peak = start;
+
+    void sample() {
+        peak = std::max(peak, process_committed_bytes());
+    }
+};
+
+// Function to advance an xorshift generator; cheap enough to sit inside the timed loops
+uint64_t bench_random(uint64_t& state) {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+// How many operations pass between two samples of the committed memory
+const size_t BENCH_PROBE_INTERVAL = 4096;
+
+// Function to benchmark replacing random members of a pool of same-sized allocations
+template <typename Api>
+void bench_churn(BenchResult& result, size_t iterations) {
+    const size_t slot_count = 1024;
+    const size_t size = 64;
+    std::vector<void*> slots(slot_count);
+    for (void*& slot : slots) {
+        slot = Api::alloc(size);
+    }
+
+    CommitProbe probe;
+    uint64_t state = 0x9E3779B97F4A7C15ull;
+    auto begin = BenchClock::now();
+    for (size_t i = 0; i < iterations; ++i) {
+        void*& slot = slots[bench_random(state) % slot_count];
+        auto start = BenchClock::now();
+        Api::release(slot);
+        auto middle = BenchClock::now();
+        slot = Api::alloc(size);
+        auto stop = BenchClock::now();
+        result.free_latency.record(start, middle);
+        result.alloc_latency.record(middle, stop);
+        if (i % BENCH_PROBE_INTERVAL == 0) {
+            probe.sample();
+        }
+    }
+    result.seconds = std::chrono::duration<double>(BenchClock::now() - begin).count();
+    result.operations = iterations * 2;
+    result.peak_committed = probe.peak - probe.start;
+
+    for (void* slot : slots) {
+        Api::release(slot);
+    }
+}
+
+// Function to benchmark replacing random members of a pool whose sizes follow a power law
+// (mostly small requests with a long tail up to 1 MiB)
+template <typename Api>
+void bench_power_law(BenchResult& result, size_t iterations) {
+    const size_t slot_count = 4096;
+    std::vector<void*> slots(slot_count, nullptr);
+    std::vector<size_t> sizes(iterations);
+    uint64_t state = 0x2545F4914F6CDD1Dull;
+    for (size_t& size : sizes) {
+        double uniform = (bench_random(state) >> 11) * (1.0 / 9007199254740992.0) + 1e-12;
+        size = std::min(static_cast<size_t>(16.0 / std::pow(uniform, 1.0 / 1.1)), size_t(1) << 20);
+    }
+
+    CommitProbe probe;
+    auto begin = BenchClock::now();
+    for (size_t i = 0; i < iterations; ++i) {
+        void*& slot = slots[bench_random(state) % slot_count];
+        if (slot) {
+            auto start = BenchClock::now();
+            Api::release(slot);
+            result.free_latency.record(start, BenchClock::now());
+            ++result.operations;
+        }
+        auto start = BenchClock::now();
+        slot = Api::alloc(sizes[i]);
+        result.alloc_latency.record(start, BenchClock::now());
+        ++result.operations;
+        if (i % BENCH_PROBE_INTERVAL == 0) {
+            probe.sample();
+        }
+    }
+    result.seconds = std::chrono::duration<double>(BenchClock::now() - begin).count();
+    result.peak_committed = probe.peak - probe.start;
+
+    for (void* slot : slots) {
+        Api::release(slot);
+    }
+}
+
+// Function to benchmark one thread allocating messages that another thread frees, passed through a
+// single-producer single-consumer ring
+template <typename Api>
+void bench_producer_consumer(BenchResult& result, size_t iterations) {
+    const size_t ring_size = 4096;
+    std::vector<void*> ring(ring_size);
+    std::atomic<size_t> head{0};  // next slot the producer fills
+    std::atomic<size_t> tail{0};  // next slot the consumer drains
+
+    CommitProbe probe;
+    auto begin = BenchClock::now();
+    std::thread consumer([&] {
+        for (size_t i = 0; i < iterations; ++i) {
+            while (tail.load(std::memory_order_relaxed) == head.load(std::memory_order_acquire)) {
+                std::this_thread::yield();
+            }
+            void* ptr = ring[i % ring_size];
+            tail.store(i + 1, std::memory_order_release);
+            auto start = BenchClock::now();
+            Api::release(ptr);
+            result.free_latency.record(start, BenchClock::now());
+        }
+    });
+
+    uint64_t state = 0xD1B54A32D192ED03ull;
+    for (size_t i = 0; i < iterations; ++i) {
+        size_t size = 16 + bench_random(state) % 496;
+        auto start = BenchClock::now();
+        void* ptr = Api::alloc(size);
+        result.alloc_latency.record(start, BenchClock::now());
+        while (i - tail.load(std::memory_order_acquire) >= ring_size) {
+            std::this_thread::yield();
+        }
+        ring[i % ring_size] = ptr;
+        head.store(i + 1, std::memory_order_release);
+        if (i % BENCH_PROBE_INTERVAL == 0) {
+            probe.sample();
+        }
+    }
+    consumer.join();
+    result.seconds = std::chrono::duration<double>(BenchClock::now() - begin).count();
+    result.operations = iterations * 2;
+    result.peak_committed = probe.peak - probe.start;
+}
+
+// Function to benchmark buffers that grow by half again per reallocation, the way appending to a
+// dynamic array does, from 16 bytes to 1 MiB
+template <typename Api>
+void bench_realloc_growth(BenchResult& result, size_t iterations) {
+    CommitProbe probe;
+    auto begin = BenchClock::now();
+    while (result.operations < iterations) {
+        size_t size = 16;
+        auto start = BenchClock::now();
+        char* buffer = static_cast<char*>(Api::alloc(size));
+        result.alloc_latency.record(start, BenchClock::now());
+        while (size < (size_t(1) << 20)) {
+            size += size / 2;
+            start = BenchClock::now();
+            buffer = static_cast<char*>(Api::resize(buffer, size));
+            result.realloc_latency.record(start, BenchClock::now());
+            buffer[size - 1] = 1;
+            ++result.operations;
+        }
+        probe.sample();
+        start = BenchClock::now();
+        Api::release(buffer);
+        result.free_latency.record(start, BenchClock::now());
+        result.operations += 2;
+    }
+    result.seconds = std::chrono::duration<double>(BenchClock::now() - begin).count();
+    result.peak_committed = probe.peak - probe.start;
+}
+
+// Function to print the p50/p99/p999 latencies of one kind of operation
+void bench_print_latency(const char* operation, LatencyLog& log) {
+    if (!log.count) {
+        return;
+    }
+    log.samples.resize(log.count);
+    std::sort(log.samples.begin(), log.samples.end());
+    auto percentile = [&](size_t per_mille) { return log.samples[(log.samples.size() - 1) * per_mille / 1000]; };
+    std::cout << "    " << operation << " p50/p99/p999: " << percentile(500) << "/" << percentile(990) << "/"
+              << percentile(999) << " ns" << std::endl;
+}
+
+// Function to run one workload against one allocator and print its figures
+template <typename Api>
+void bench_run(const char* workload, void (*bench)(BenchResult&, size_t), size_t iterations) {
+    BenchResult result(iterations * 2);
+    bench(result, iterations);
+    std::cout << workload << " [" << Api::name() << "]: " << result.operations / result.seconds / 1e6
+              << " Mops/s, peak committed +" << result.peak_committed / 1024 << " KiB" << std::endl;
+    bench_print_latency("alloc", result.alloc_latency);
+    bench_print_latency("free", result.free_latency);
+    bench_print_latency("realloc", result.realloc_latency);
+}
+
+// Function to run every workload against one allocator
+template <typename Api>
+void bench_api(size_t iterations) {
+    bench_run<Api>("fixed-size churn", bench_churn<Api>, iterations);
+    bench_run<Api>("power-law sizes", bench_power_law<Api>, iterations);
+    bench_run<Api>("producer/consumer", bench_producer_consumer<Api>, iterations);
+    bench_run<Api>("realloc growth", bench_realloc_growth<Api>, iterations);
+}
+
+// Function to run the benchmark suite against this allocator and the system baselines
+void benchmark(size_t iterations) {
+    default_arena_size = 1 << 20;
+    bench_api<MemApi>(iterations);
+    bench_api<MallocApi>(iterations);
+#ifdef _WIN32
+    bench_api<HeapApi>(iterations);
+#endif
+}
+
+// TraceEvent structure to represent one call of a loaded trace, its pointers replaced by dense ids
+struct TraceEvent {
+    uint32_t op;  // TraceOp
+    uint32_t id;  // allocation the call creates, frees or resizes
+    uint64_t size;
+};
+
+// TraceScript structure to represent a loaded trace ready to be replayed
+struct TraceScript {
+    std::vector<TraceEvent> events;
+    size_t id_count = 0;
+};
+
+// Function to load a trace log into a script: every thread's records are merged in time order and
+// each allocation is given an id, so a replay needs no lookups; calls on unknown pointers are skipped
+bool trace_load(const char* path, TraceScript& script) {
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        return false;
+    }
+
+    // Absolute time, thread and record of every call
+    struct Timed {
+        uint64_t time;
+        uint32_t thread;
+        TraceRecord record;
+    };
+    std::vector<Timed> calls;
+    TraceChunk chunk;
+    bool ok = true;
+    while (fread(&chunk, sizeof(chunk), 1, file) == 1) {
+        if (chunk.magic != TRACE_MAGIC || chunk.count > TRACE_CHUNK_RECORDS) {
+            ok = false;
+            break;
+        }
+        uint64_t time = chunk.start;
+        for (uint64_t i = 0; i < chunk.count; ++i) {
+            Timed call;
+            if (fread(&call.record, sizeof(call.record), 1, file) != 1) {
+                ok = false;
+                break;
+            }
+            time += call.record.delta;
+            call.time = time;
+            call.thread = chunk.thread;
+            calls.push_back(call);
+        }
+    }
+    fclose(file);
+    std::stable_sort(calls.begin(), calls.end(), [](const Timed& a, const Timed& b) { return a.time < b.time; });
+
+    std::unordered_map<uint64_t, uint32_t> live;
+    auto create = [&](uint64_t ptr, uint64_t size) {
+        uint32_t id = static_cast<uint32_t>(script.id_count++);
+        live[ptr] = id;
+        script.events.push_back({TRACE_ALLOC, id, size});
+    };
+    for (const Timed& call : calls) {
+        const TraceRecord& record = call.record;
+        auto found = live.find(record.ptr);
+        switch (record.op) {
+        case TRACE_ALLOC:
+            if (record.ptr) {
+                create(record.ptr, record.size);
+            }
+            break;
+        case TRACE_FREE:
+            if (found != live.end()) {
+                script.events.push_back({TRACE_FREE, found->second, 0});
+                live.erase(found);
+            }
+            break;
+        case TRACE_REALLOC:
+            if (!record.result) {
+                break;
+            }
+            if (found == live.end()) {
+                create(record.result, record.size);
+                break;
+            }
+            {
+                uint32_t id = found->second;
+                live.erase(found);
+                live[record.result] = id;
+                script.events.push_back({TRACE_REALLOC, id, record.size});
+            }
+            break;
+        }
+    }
+    return ok;
+}
+
+// Function to replay a loaded trace against one allocator as fast as it will go and print its figures;
+// every thread's calls are replayed on the calling thread
+template <typename Api>
+void trace_replay(const TraceScript& script) {
+    std::vector<void*> slots(script.id_count, nullptr);
+    CommitProbe probe;
+    auto begin = BenchClock::now();
+    for (size_t i = 0; i < script.events.size(); ++i) {
+        const TraceEvent& event = script.events[i];
+        void*& slot = slots[event.id];
+        switch (event.op) {
+        case TRACE_ALLOC:
+            slot = Api::alloc(event.size);
+            break;
+        case TRACE_FREE:
+            if (slot) {
+                Api::release(slot);
+                slot = nullptr;
+            }
+            break;
+        case TRACE_REALLOC:
+            if (void* ptr = slot ? Api::resize(slot, event.size) : Api::alloc(event.size)) {
+                slot = ptr;
+            }
+            break;
+        }
+        if (i % BENCH_PROBE_INTERVAL == 0) {
+            probe.sample();
+        }
+    }
+    double seconds = std::chrono::duration<double>(BenchClock::now() - begin).count();
+
+    for (void* ptr : slots) {
+        if (ptr) {
+            Api::release(ptr);
+        }
+    }
+    std::cout << "replay [" << Api::name() << "]: " << script.events.size() / seconds / 1e6
+              << " Mops/s, peak committed +" << (probe.peak - probe.start) / 1024 << " KiB" << std::endl;
+}
+
+// Function to replay a trace log against this allocator and the system baselines
+void replay(const char* path) {
+    TraceScript script;
+    if (!trace_load(path, script)) {
+        std::cout << "replay: cannot read every chunk of " << path << std::endl;
+    }
+    std::cout << "replay: " << script.events.size() << " calls, " << script.id_count << " allocations" << std::endl;
+
+    default_arena_size = 1 << 20;
+    trace_replay<MemApi>(script);
+    trace_replay<MallocApi>(script);
+#ifdef _WIN32
+    trace_replay<HeapApi>(script);
+#endif
+}
+
+// Function to run one fit strategy through a fixed random workload on a fresh heap and report its
+// allocation latency and the external fragmentation it leaves behind
+template <typename FitPolicy>
+void fit_trial(const char* name, size_t iterations, size_t max_block_size) {
+    Allocator<FitPolicy> allocator;
+    std::vector<void*> allocations;
+    std::vector<double> latencies;
+    srand(1);  // same workload for every strategy
+
+    for (size_t i = 0; i < iterations; ++i) {
+        if (allocations.empty() || rand() % 5 < 3) {
+            // Slab-sized requests never reach the fit strategy
+            size_t size = SLAB_MAX_SIZE + 1 + rand() % max_block_size;
+            auto start = std::chrono::steady_clock::now();
+            void* ptr = allocator.mem_alloc(size);
+            auto stop = std::chrono::steady_clock::now();
+            latencies.push_back(std::chrono::duration<double, std::nano>(stop - start).count());
+            if (ptr) {
+                allocations.push_back(ptr);
+            }
+        } else {
+            size_t index = rand() % allocations.size();
+            allocator.mem_free(allocations[index]);
+            allocations[index] = allocations.back();
+            allocations.pop_back();
+        }
+    }
+
+    double fragmentation = allocator.fragmentation();
+    for (void* ptr : allocations) {
+        allocator.mem_free(ptr);
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+    double total = 0;
+    for (double latency : latencies) {
+        total += latency;
+    }
+    std::cout << name << ": mean " << total / latencies.size() << " ns, p99 "
+              << latencies[latencies.size() * 99 / 100] << " ns, external fragmentation "
+              << fragmentation * 100 << "%" << std::endl;
+}
+
+// Function to compare the fit strategies on the same workload
+void fit_tester(size_t iterations, size_t max_block_size) {
+    default_arena_size = 1 << 20;
+    fit_trial<GoodFit>("good-fit", iterations, max_block_size);
+    fit_trial<ExactFit>("exact-fit", iterations, max_block_size);
+    fit_trial<BestFit>("best-fit", iterations, max_block_size);
+    fit_trial<NextFit>("next-fit", iterations, max_block_size);
+}
+
+// VerifySlot structure to represent a live allocation of the integrity check and the checksum its
+// contents must keep
+struct VerifySlot {
+    char* ptr = nullptr;
+    size_t size = 0;
+    uint64_t sum = 0;
+};
+
+// VerifyRun structure to represent the progress of an integrity check
+struct VerifyRun {
+    uint64_t state = 0x853C49E6748FEA9Bull;
+    size_t checked_bytes = 0;
+    size_t mismatches = 0;
+
+    // Function to draw a request size: mostly slab sizes, a share of arena sizes and a few large mappings
+    size_t size() {
+        uint64_t draw = wyrand(state);
+        size_t limit = draw % 8 < 5 ? SLAB_MAX_SIZE : draw % 8 < 7 ? 16 << 10 : 1 << 20;
+        return 1 + (draw >> 8) % limit;
+    }
+
+    // Function to check that the first size bytes at ptr still sum to what was stored
+    void check(const char* what, const void* ptr, size_t size, uint64_t sum) {
+        checked_bytes += size;
+        if (checksum(ptr, size) != sum) {
+            if (++mismatches <= 16) {
+                std::cout << "verify: " << what << " of " << size << " bytes at " << ptr << " lost data" << std::endl;
+            }
+        }
+    }
+
+    // Function to check that the size bytes at ptr, just handed out by mem_calloc, are all zero
+    void check_zero(const void* ptr, size_t size) {
+        checked_bytes += size;
+        const char* bytes = static_cast<const char*>(ptr);
+        if (std::any_of(bytes, bytes + size, [](char byte) { return byte != 0; })) {
+            if (++mismatches <= 16) {
+                std::cout << "verify: calloc of " << size << " bytes at " << ptr << " not zeroed" << std::endl;
+            }
+        }
+    }
+
+    // Function to fill the whole of a slot with random bytes and store their checksum
+    void fill(VerifySlot& slot) {
+        random_input(slot.ptr, slot.size, state);
+        slot.sum = checksum(slot.ptr, slot.size);
+    }
+};
+
+// Function to run random mem_alloc, mem_calloc, mem_realloc and mem_free calls over blocks holding
+// random bytes, checking every block's contents after each realloc, before each free and at the end,
+// so data lost in split, coalesce or grow-in-place shows, and that calloc hands out zeroes even where
+// dirty memory was freed just before; returns the number of blocks found damaged
+size_t verify(size_t iterations) {
+    const size_t slot_count = 1024;
+    std::vector<VerifySlot> slots(slot_count);
+    VerifyRun run;
+    auto begin = BenchClock::now();
+
+    // A large block is kept as the spare mapping with its contents when freed
+    const size_t large_size = 2 << 20;
+    if (char* large = static_cast<char*>(mem_alloc(large_size))) {
+        memset(large, 0xAB, large_size);
+        mem_free(large);
+    }
+    if (void* zeroed = mem_calloc(1, large_size)) {
+        run.check_zero(zeroed, large_size);
+        mem_free(zeroed);
+    }
+
+    for (size_t i = 0; i < iterations; ++i) {
+        VerifySlot& slot = slots[wyrand(run.state) % slot_count];
+        if (!slot.ptr) {
+            slot.size = run.size();
+            bool zeroed = wyrand(run.state) % 4 == 0;
+            slot.ptr = static_cast<char*>(zeroed ? mem_calloc(1, slot.size) : mem_alloc(slot.size));
+            if (slot.ptr) {
+                if (zeroed) {
+                    run.check_zero(slot.ptr, slot.size);
+                }
+                run.fill(slot);
+            }
+        } else if (wyrand(run.state) % 3) {
+            // Grow by half half the time, the pattern that takes the in-place paths, else resize at random
+            size_t size = wyrand(run.state) % 2 ? slot.size + slot.size / 2 : run.size();
+            size_t kept = std::min(size, slot.size);
+            uint64_t kept_sum = kept == slot.size ? slot.sum : checksum(slot.ptr, kept);
+            char* ptr = static_cast<char*>(mem_realloc(slot.ptr, size));
+            if (!ptr) {
+                continue;
+            }
+            run.check("realloc", ptr, kept, kept_sum);
+            slot.ptr = ptr;
+            slot.size = size;
+            random_input(ptr + kept, size - kept, run.state);
+            slot.sum = size == kept ? kept_sum : checksum(ptr, size);
+        } else {
+            run.check("free", slot.ptr, slot.size, slot.sum);
+            mem_free(slot.ptr);
+            slot.ptr = nullptr;
+        }
+    }
+
+    for (VerifySlot& slot : slots) {
+        if (slot.ptr) {
+            run.check("final check", slot.ptr, slot.size, slot.sum);
+            mem_free(slot.ptr);
+        }
+    }
+    double seconds = std::chrono::duration<double>(BenchClock::now() - begin).count();
+    std::cout << "verify: " << iterations << " operations, " << run.checked_bytes / double(1 << 30) << " GiB checked, "
+              << run.checked_bytes / seconds / double(1 << 30) << " GiB/s, " << run.mismatches << " damaged blocks"
+              << std::endl;
+    return run.mismatches;
+}
+
+// Function to run worker threads whose blocks outlive them and are freed by another thread, then a
+// second round that adopts their heaps, and check that every arena they made is released once they have
+// exited; returns whether the arena count came back to where it started
+bool thread_exit_check(size_t thread_count) {
+    void* warm = mem_alloc(1 << 10);  // gives the main thread its heap and arena up front
+    size_t baseline = mem_stats().arenas;
+
+    std::vector<std::vector<void*>> blocks(thread_count);
+    std::vector<std::thread> workers;
+    for (size_t t = 0; t < thread_count; ++t) {
+        workers.emplace_back([&blocks, t] {
+            uint64_t state = t + 1;
+            for (size_t i = 0; i < 4096; ++i) {
+                blocks[t].push_back(mem_alloc(SLAB_MAX_SIZE + 1 + wyrand(state) % (64 << 10)));
+            }
+        });
+    }
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    size_t peak = mem_stats().arenas;
+    // Freed from a thread of its own, whose cache is flushed when it exits
+    std::thread([&blocks] {
+        for (std::vector<void*>& owned : blocks) {
+            for (void* ptr : owned) {
+                mem_free(ptr);
+            }
+        }
+    }).join();
+    size_t after_free = mem_stats().arenas;
+
+    workers.clear();
+    for (size_t t = 0; t < thread_count; ++t) {
+        workers.emplace_back([] {
+            for (size_t i = 0; i < 64; ++i) {
+                mem_free(mem_alloc(32 << 10));
+            }
+        });
+    }
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    size_t after_reuse = mem_stats().arenas;
+    mem_free(warm);
+
+    std::cout << "threads: " << baseline << " arenas before, " << peak << " with the workers' blocks live, "
+              << after_free << " once freed, " << after_reuse << " after a second round" << std::endl;
+    return after_free == baseline && after_reuse == baseline;
+}
+
+// ScavengeSlot structure to represent a block of the scavenger check, shared between its threads, and
+// the source it must go back to
+struct ScavengeSlot {
+    std::mutex mutex;
+    VerifySlot block;
+    int source = 0;  // 0 for mem_alloc, 1 for mem_alloc_on_node, 2 for the shared Allocator
+};
+
+// Function to run threads that allocate blocks of random bytes into shared slots and free each other's,
+// from the per-thread heaps, a node heap and a shared Allocator, with the scavenger running every
+// millisecond and a low decommit threshold, so the hand-over, the scavenger's stand-in for an idle
+// locked heap and the return of the blocks it holds all run under load; every block is checked before
+// it is freed. Returns whether no block was damaged and bytes_in_use came back to where it started
+bool scavenge_check(size_t thread_count, size_t iterations) {
+    size_t threshold = decommit_threshold.exchange(16 << 10);
+    size_t baseline = mem_stats().bytes_in_use;
+    if (!mem_scavenger_start(std::chrono::milliseconds(1))) {
+        std::cout << "scavenge: the scavenger is already running" << std::endl;
+        return false;
+    }
+
+    SharedAllocator shared;
+    std::vector<ScavengeSlot> slots(thread_count * 256);
+    std::atomic<size_t> checked_bytes{0};
+    std::atomic<size_t> mismatches{0};
+    auto release = [&shared](ScavengeSlot& slot) {
+        if (slot.source == 2) {
+            shared.mem_free(slot.block.ptr);
+        } else {
+            mem_free(slot.block.ptr);
+        }
+        slot.block.ptr = nullptr;
+    };
+
+    auto begin = BenchClock::now();
+    std::vector<std::thread> workers;
+    for (size_t t = 0; t < thread_count; ++t) {
+        workers.emplace_back([&, t] {
+            VerifyRun run;
+            run.state += t;
+            for (size_t i = 0; i < iterations; ++i) {
+                ScavengeSlot& slot = slots[wyrand(run.state) % slots.size()];
+                std::lock_guard<std::mutex> lock(slot.mutex);
+                if (slot.block.ptr) {
+                    run.check("free", slot.block.ptr, slot.block.size, slot.block.sum);
+                    release(slot);
+                    continue;
+                }
+                slot.block.size = run.size();
+                slot.source = static_cast<int>(wyrand(run.state) % 3);
+                void* ptr = slot.source == 0   ? mem_alloc(slot.block.size)
+                            : slot.source == 1 ? mem_alloc_on_node(slot.block.size, 0)
+                                               : shared.mem_alloc(slot.block.size);
+                slot.block.ptr = static_cast<char*>(ptr);
+                if (slot.block.ptr) {
+                    run.fill(slot.block);
+                }
+            }
+            checked_bytes += run.checked_bytes;
+            mismatches += run.mismatches;
+        });
+    }
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+
+    // Let the scavenger take over the heaps the workers left behind before their blocks go back
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    VerifyRun run;
+    for (ScavengeSlot& slot : slots) {
+        if (slot.block.ptr) {
+            run.check("final check", slot.block.ptr, slot.block.size, slot.block.sum);
+            release(slot);
+        }
+    }
+    mem_scavenger_stop();
+    decommit_threshold = threshold;
+    checked_bytes += run.checked_bytes;
+    mismatches += run.mismatches;
+
+    size_t in_use = mem_stats().bytes_in_use;
+    double seconds = std::chrono::duration<double>(BenchClock::now() - begin).count();
+    std::cout << "scavenge: " << thread_count << " threads, " << thread_count * iterations << " operations in "
+              << seconds << " s, " << checked_bytes / double(1 << 20) << " MiB checked, " << mismatches
+              << " damaged blocks, " << baseline << " bytes in use before and " << in_use << " after" << std::endl;
+    return mismatches == 0 && in_use == baseline;
+}
+
+// Function to fill a handle's bytes with random data behind a header of their size and checksum, so a
+// thread holding only the handle can check them
+void handle_fill(char* data, size_t size, uint64_t& state) {
+    random_input(data + 2 * sizeof(uint64_t), size - 2 * sizeof(uint64_t), state);
+    uint64_t header[2] = {size, checksum(data + 2 * sizeof(uint64_t), size - 2 * sizeof(uint64_t))};
+    memcpy(data, header, sizeof(header));
+}
+
+// Function to check the bytes of a handle filled by handle_fill
+bool handle_intact(const char* data) {
+    uint64_t header[2];
+    memcpy(header, data, sizeof(header));
+    return checksum(data + sizeof(header), header[0] - sizeof(header)) == header[1];
+}
+
+// Function to run threads that pin handles, check their bytes and unpin them while the main thread
+// frees and replaces handles at random (freeing some while they are pinned, which the last unpin
+// finishes) and compacts its heap in small slices under them; returns whether no pinned block was
+// found damaged and bytes_in_use came back to where it started
+bool handle_check(size_t thread_count, size_t rounds) {
+    const size_t handle_count = 4096;
+    size_t baseline = mem_stats().bytes_in_use;
+    std::vector<std::atomic<MemHandle>> handles(handle_count);
+    VerifyRun run;
+    auto draw_size = [&run] { return 2 * sizeof(uint64_t) + wyrand(run.state) % (4 << 10); };
+    for (std::atomic<MemHandle>& handle : handles) {
+        size_t size = draw_size();
+        MemHandle fresh = mem_handle_alloc(size);
+        handle_fill(static_cast<char*>(mem_handle_pin(fresh)), size, run.state);
+        mem_handle_unpin(fresh);
+        handle.store(fresh);
+    }
+
+    std::atomic<bool> done{false};
+    std::atomic<size_t> pins{0};
+    std::atomic<size_t> mismatches{0};
+    std::vector<std::thread> workers;
+    for (size_t t = 0; t < thread_count; ++t) {
+        workers.emplace_back([&, t] {
+            uint64_t state = t + 1;
+            size_t pinned = 0;
+            while (!done.load(std::memory_order_relaxed)) {
+                MemHandle handle = handles[wyrand(state) % handle_count].load();
+                // A handle freed since it was read is refused
+                if (const char* data = static_cast<const char*>(mem_handle_pin(handle))) {
+                    ++pinned;
+                    if (!handle_intact(data) && ++mismatches <= 16) {
+                        std::cout << "handles: handle " << handle << " at " << static_cast<const void*>(data)
+                                  << " lost data" << std::endl;
+                    }
+                    mem_handle_unpin(handle);
+                }
+            }
+            pins += pinned;
+        });
+    }
+
+    auto begin = BenchClock::now();
+    size_t moved = 0;
+    size_t passes = 0;
+    for (size_t round = 0; round < rounds; ++round) {
+        // Replace a share of the handles, leaving gaps behind for the slices to close
+        for (size_t i = 0; i < handle_count / 16; ++i) {
+            mem_handle_free(handles[wyrand(run.state) % handle_count].exchange(0));
+        }
+        for (std::atomic<MemHandle>& handle : handles) {
+            if (!handle.load()) {
+                size_t size = draw_size();
+                MemHandle fresh = mem_handle_alloc(size);
+                handle_fill(static_cast<char*>(mem_handle_pin(fresh)), size, run.state);
+                mem_handle_unpin(fresh);
+                handle.store(fresh);
+            }
+        }
+        while (!mem_compact(16 << 10, &moved)) {
+        }
+        ++passes;
+    }
+    done = true;
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    for (std::atomic<MemHandle>& handle : handles) {
+        MemHandle last = handle.exchange(0);
+        if (const char* data = static_cast<const char*>(mem_handle_pin(last))) {
+            if (!handle_intact(data)) {
+                ++mismatches;
+            }
+            mem_handle_unpin(last);
+        }
+        mem_handle_free(last);
+    }
+
+    size_t in_use = mem_stats().bytes_in_use;
+    double seconds = std::chrono::duration<double>(BenchClock::now() - begin).count();
+    std::cout << "handles: " << thread_count << " threads, " << pins << " pins, " << passes << " compaction passes, "
+              << moved / double(1 << 20) << " MiB moved in " << seconds << " s, " << mismatches << " damaged blocks, "
+              << baseline << " bytes in use before and " << in_use << " after" << std::endl;
+    return mismatches == 0 && in_use == baseline;
+}
+
+// Function to fill scopes with blocks of random bytes, a few of them too large for a chunk, and check
+// every block before each reset, so overlapping bump allocations show, and that ending the scope gives
+// back every byte its chunks reserved
+void api_scopes(VerifyRun& run, size_t iterations) {
+    size_t reserved = mem_stats().reserved;
+    Scope* scope = mem_scope_begin();
+    std::vector<VerifySlot> blocks;
+    for (size_t i = 0; i < iterations; ++i) {
+        VerifySlot slot;
+        slot.size = wyrand(run.state) % 256 ? run.size() : SCOPE_CHUNK_SIZE + 1 + wyrand(run.state) % (1 << 20);
+        slot.ptr = static_cast<char*>(mem_scope_alloc(scope, slot.size));
+        if (slot.ptr) {
+            run.fill(slot);
+            blocks.push_back(slot);
+        }
+        if (wyrand(run.state) % 512 == 0 || i + 1 == iterations) {
+            for (const VerifySlot& block : blocks) {
+                run.check("scope alloc", block.ptr, block.size, block.sum);
+            }
+            blocks.clear();
+            mem_scope_reset(scope);
+        }
+    }
+    mem_scope_end(scope);
+    if (mem_stats().reserved != reserved) {
+        std::cout << "api: " << mem_stats().reserved - reserved << " bytes still reserved after mem_scope_end" << std::endl;
+        ++run.mismatches;
+    }
+}
+
+// Function to allocate batches of random bytes with mem_alloc_batch and free each, shuffled and with
+// gaps, with mem_free_batch one batch later; every block is checked before it is freed, and the array
+// passed to mem_free_batch must come back as it was
+void api_batches(VerifyRun& run, size_t iterations) {
+    std::vector<VerifySlot> live;
+    std::vector<void*> ptrs;
+    for (size_t i = 0; i < iterations / 16; ++i) {
+        size_t size = run.size();
+        // enough blocks of the small sizes to cross a FREE_BATCH_CHUNK boundary
+        size_t count = 1 + wyrand(run.state) % (size <= SLAB_MAX_SIZE ? 600 : size <= (16 << 10) ? 64 : 4);
+        std::vector<void*> out(count);
+        size_t done = mem_alloc_batch(size, count, out.data());
+        std::vector<VerifySlot> batch(done);
+        for (size_t j = 0; j < done; ++j) {
+            batch[j].ptr = static_cast<char*>(out[j]);
+            batch[j].size = size;
+            run.fill(batch[j]);
+        }
+
+        ptrs.clear();
+        for (const VerifySlot& slot : live) {
+            run.check("batch alloc", slot.ptr, slot.size, slot.sum);
+            ptrs.push_back(slot.ptr);
+            if (wyrand(run.state) % 8 == 0) {
+                ptrs.push_back(nullptr);
+            }
+        }
+        for (size_t j = ptrs.size(); j > 1; --j) {
+            std::swap(ptrs[j - 1], ptrs[wyrand(run.state) % j]);
+        }
+        std::vector<void*> passed = ptrs;
+        mem_free_batch(ptrs.data(), ptrs.size());
+        if (ptrs != passed && ++run.mismatches <= 16) {
+            std::cout << "api: mem_free_batch reordered the " << ptrs.size() << " pointers it was given" << std::endl;
+        }
+        live = std::move(batch);
+    }
+    for (const VerifySlot& slot : live) {
+        run.check("batch alloc", slot.ptr, slot.size, slot.sum);
+        mem_free(slot.ptr);
+    }
+}
+
+// ApiLine structure to represent an over-aligned element for the StlAllocator check
+struct alignas(64) ApiLine {
+    uint64_t words[8];
+};
+
+// Function to grow and shrink containers on mem_resource and StlAllocator next to copies on the
+// standard heap and check they keep the same contents, and that over-aligned elements land aligned
+void api_containers(VerifyRun& run, size_t iterations) {
+    std::pmr::vector<char> bytes(mem_resource());
+    std::vector<char> bytes_copy;
+    std::pmr::unordered_map<uint64_t, uint64_t> map(mem_resource());
+    std::vector<ApiLine, StlAllocator<ApiLine>> lines;
+    const uint64_t line_seed = run.state;
+    uint64_t line_state = line_seed;
+    for (size_t i = 0; i < iterations; ++i) {
+        uint64_t draw = wyrand(run.state);
+        if (draw % 64 == 0) {
+            run.check("memory_resource vector", bytes.data(), bytes.size(), checksum(bytes_copy.data(), bytes_copy.size()));
+            bytes.clear();
+            bytes.shrink_to_fit();
+            bytes_copy.clear();
+        }
+        size_t grow = draw >> 8 & 255;
+        char chunk[256];
+        random_input(chunk, grow, run.state);
+        bytes.insert(bytes.end(), chunk, chunk + grow);
+        bytes_copy.insert(bytes_copy.end(), chunk, chunk + grow);
+
+        uint64_t key = draw % 4096;
+        if (draw & 16) {
+            map[key] = key * 0x9E3779B97F4A7C15ull;
+        } else {
+            map.erase(key);
+        }
+
+        if (draw % 8 == 0) {
+            ApiLine line;
+            for (uint64_t& word : line.words) {
+                word = wyrand(line_state);
+            }
+            lines.push_back(line);
+        }
+    }
+    run.check("memory_resource vector", bytes.data(), bytes.size(), checksum(bytes_copy.data(), bytes_copy.size()));
+    for (const auto& entry : map) {
+        run.checked_bytes += sizeof(entry);
+        if (entry.second != entry.first * 0x9E3779B97F4A7C15ull && ++run.mismatches <= 16) {
+            std::cout << "api: memory_resource map entry " << entry.first << " lost its value" << std::endl;
+        }
+    }
+    if (reinterpret_cast<uintptr_t>(lines.data()) % alignof(ApiLine) && ++run.mismatches <= 16) {
+        std::cout << "api: StlAllocator placed over-aligned elements at " << lines.data() << std::endl;
+    }
+    // The lines' words are drawn again from the same seed
+    line_state = line_seed;
+    for (const ApiLine& line : lines) {
+        run.checked_bytes += sizeof(line);
+        for (uint64_t word : line.words) {
+            if (word != wyrand(line_state)) {
+                if (++run.mismatches <= 16) {
+                    std::cout << "api: StlAllocator vector element at " << &line << " lost data" << std::endl;
+                }
+                return;
+            }
+        }
+    }
+}
+
+// Function to run random mem_alloc, mem_calloc and mem_realloc calls, some of them sampled into the
+// guard pool, and free every block with mem_free_sized after checking it, so the cache's bin and the
+// statistics both go by the size the caller passes; bytes_in_use must come back to where it started
+void api_sized_frees(VerifyRun& run, size_t iterations) {
+    size_t baseline = mem_stats().bytes_in_use;
+    mem_guard_sample(64);
+    std::vector<VerifySlot> slots(256);
+    for (size_t i = 0; i < iterations; ++i) {
+        VerifySlot& slot = slots[wyrand(run.state) % slots.size()];
+        if (!slot.ptr) {
+            slot.size = run.size();
+            slot.ptr = static_cast<char*>(wyrand(run.state) % 4 ? mem_alloc(slot.size) : mem_calloc(1, slot.size));
+        } else if (wyrand(run.state) % 4 == 0) {
+            run.check("sized free", slot.ptr, slot.size, slot.sum);
+            size_t size = run.size();
+            char* ptr = static_cast<char*>(mem_realloc(slot.ptr, size));
+            if (!ptr) {
+                continue;
+            }
+            slot.ptr = ptr;
+            slot.size = size;
+        } else {
+            run.check("sized free", slot.ptr, slot.size, slot.sum);
+            mem_free_sized(slot.ptr, slot.size);
+            slot.ptr = nullptr;
+        }
+        if (slot.ptr) {
+            run.fill(slot);
+        }
+    }
+    for (VerifySlot& slot : slots) {
+        if (slot.ptr) {
+            run.check("sized free", slot.ptr, slot.size, slot.sum);
+            mem_free_sized(slot.ptr, slot.size);
+        }
+    }
+    mem_guard_sample(0);
+    // The thread cache holds on to the blocks, but they count as freed
+    size_t in_use = mem_stats().bytes_in_use;
+    if (in_use != baseline && ++run.mismatches <= 16) {
+        std::cout << "api: mem_free_sized left " << in_use - baseline << " bytes in use" << std::endl;
+    }
+}
+
+// Function to allocate blocks of random bytes on each NUMA node in turn and give them back through
+// mem_free or mem_realloc, checking each block first and that arena blocks came from the node's heap;
+// a node past os_node_count() must be refused
+void api_node_allocs(VerifyRun& run, size_t iterations) {
+    if (mem_alloc_on_node(64, os_node_count()) && ++run.mismatches <= 16) {
+        std::cout << "api: mem_alloc_on_node accepted node " << os_node_count() << std::endl;
+    }
+    std::vector<VerifySlot> slots(256);
+    for (size_t i = 0; i < iterations; ++i) {
+        VerifySlot& slot = slots[wyrand(run.state) % slots.size()];
+        if (!slot.ptr) {
+            int node = static_cast<int>(i % os_node_count());
+            slot.size = run.size();
+            slot.ptr = static_cast<char*>(mem_alloc_on_node(slot.size, node));
+            if (!slot.ptr) {
+                continue;
+            }
+            Region region = ptr_region(slot.ptr);
+            if (region.kind == REGION_ARENA && static_cast<Arena*>(region.descriptor)->heap != node_heaps[node].heap &&
+                ++run.mismatches <= 16) {
+                std::cout << "api: block at " << static_cast<void*>(slot.ptr) << " is not in node " << node << "'s heap"
+                          << std::endl;
+            }
+            run.fill(slot);
+        } else if (wyrand(run.state) % 4 == 0) {
+            run.check("node alloc", slot.ptr, slot.size, slot.sum);
+            size_t size = slot.size + slot.size / 2;
+            char* ptr = static_cast<char*>(mem_realloc(slot.ptr, size));
+            if (!ptr) {
+                continue;
+            }
+            run.check("node alloc", ptr, slot.size, slot.sum);
+            slot.ptr = ptr;
+            slot.size = size;
+            run.fill(slot);
+        } else {
+            run.check("node alloc", slot.ptr, slot.size, slot.sum);
+            mem_free(slot.ptr);
+            slot.ptr = nullptr;
+        }
+    }
+    for (VerifySlot& slot : slots) {
+        if (slot.ptr) {
+            run.check("node alloc", slot.ptr, slot.size, slot.sum);
+            mem_free(slot.ptr);
+        }
+    }
+}
+
+// Function to run random allocations, reallocations and frees of blocks of random bytes through an
+// Allocator instance, checking each block before it moves or goes and that every payload keeps the
+// instance's alignment; the instance is destroyed with all its blocks freed
+template <typename AllocatorType>
+void api_allocator(VerifyRun& run, size_t iterations, const char* what, size_t alignment) {
+    AllocatorType allocator;
+    std::vector<VerifySlot> slots(256);
+    size_t misaligned = 0;
+    for (size_t i = 0; i < iterations; ++i) {
+        VerifySlot& slot = slots[wyrand(run.state) % slots.size()];
+        if (!slot.ptr) {
+            slot.size = run.size();
+            slot.ptr = static_cast<char*>(allocator.mem_alloc(slot.size));
+        } else if (wyrand(run.state) % 3 == 0) {
+            run.check(what, slot.ptr, slot.size, slot.sum);
+            size_t size = wyrand(run.state) % 2 ? slot.size + slot.size / 2 : run.size();
+            size_t kept = std::min(size, slot.size);
+            uint64_t kept_sum = checksum(slot.ptr, kept);
+            char* ptr = static_cast<char*>(allocator.mem_realloc(slot.ptr, size));
+            if (!ptr) {
+                continue;
+            }
+            run.check(what, ptr, kept, kept_sum);
+            slot.ptr = ptr;
+            slot.size = size;
+        } else {
+            run.check(what, slot.ptr, slot.size, slot.sum);
+            allocator.mem_free(slot.ptr);
+            slot.ptr = nullptr;
+        }
+        if (slot.ptr) {
+            misaligned += reinterpret_cast<uintptr_t>(slot.ptr) % alignment != 0;
+            run.fill(slot);
+        }
+    }
+    for (VerifySlot& slot : slots) {
+        if (slot.ptr) {
+            run.check(what, slot.ptr, slot.size, slot.sum);
+            allocator.mem_free(slot.ptr);
+        }
+    }
+    if (misaligned) {
+        run.mismatches += misaligned;
+        std::cout << "api: " << what << " handed out " << misaligned << " blocks off " << alignment << "-byte alignment"
+                  << std::endl;
+    }
+}
+
+// Function to run an Allocator instance over arenas reserved with arena_large_pages set, large pages or
+// the fallback to ordinary ones, checking its blocks as api_allocator does and that destroying it
+// releases every arena it made
+void api_large_pages(VerifyRun& run, size_t iterations) {
+    bool large_pages = arena_large_pages.exchange(true);
+    MemStats before = mem_stats();
+    api_allocator<EmbeddedAllocator>(run, iterations, "large-page arena", ALIGNMENT);
+    MemStats after = mem_stats();
+    arena_large_pages = large_pages;
+    if (after.arenas != before.arenas && ++run.mismatches <= 16) {
+        std::cout << "api: " << after.arenas - before.arenas << " large-page arenas left after the allocator went"
+                  << std::endl;
+    }
+}
+
+// Function to drive the APIs the other modes leave alone, each over blocks of random bytes checked
+// before they are given back; returns whether no block was damaged and bytes_in_use came back to where
+// it started
+bool api_check(size_t iterations) {
+    size_t baseline = mem_stats().bytes_in_use;
+    VerifyRun run;
+    auto begin = BenchClock::now();
+    api_scopes(run, iterations);
+    api_batches(run, iterations);
+    api_containers(run, iterations);
+    api_sized_frees(run, iterations);
+    api_node_allocs(run, iterations);
+    api_allocator<EmbeddedAllocator>(run, iterations, "EmbeddedAllocator", ALIGNMENT);
+    api_allocator<SharedAllocator>(run, iterations, "SharedAllocator", 64);
+    api_large_pages(run, iterations);
+
+    size_t in_use = mem_stats().bytes_in_use;
+    double seconds = std::chrono::duration<double>(BenchClock::now() - begin).count();
+    std::cout << "api: " << iterations << " operations each, " << run.checked_bytes / double(1 << 20) << " MiB checked in "
+              << seconds << " s, " << run.mismatches << " damaged blocks, " << baseline << " bytes in use before and "
+              << in_use << " after" << std::endl;
+    return run.mismatches == 0 && in_use == baseline;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc > 1 && std::strcmp(argv[1], "bench") == 0) {
+        benchmark(argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 1000000);
+        return 0;
+    }
+    if (argc > 2 && std::strcmp(argv[1], "trace") == 0) {
+        // Record the benchmark workloads' calls, e.g. as a sample log for replay
+        if (!trace_start(argv[2])) {
+            std::cout << "trace: cannot create " << argv[2] << std::endl;
+            return 1;
+        }
+        default_arena_size = 1 << 20;
+        bench_api<MemApi>(argc > 3 ? std::strtoul(argv[3], nullptr, 10) : 100000);
+        trace_stop();
+        return 0;
+    }
+    if (argc > 2 && std::strcmp(argv[1], "replay") == 0) {
+        replay(argv[2]);
+        return 0;
+    }
+    if (argc > 1 && std::strcmp(argv[1], "fit") == 0) {
+        fit_tester(argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 100000, 4096);
+        return 0;
+    }
+    if (argc > 1 && std::strcmp(argv[1], "threads") == 0) {
+        default_arena_size = 1 << 20;
+        return thread_exit_check(argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 8) ? 0 : 1;
+    }
+    if (argc > 1 && std::strcmp(argv[1], "scavenge") == 0) {
+        default_arena_size = 1 << 20;
+        return scavenge_check(argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 8,
+                              argc > 3 ? std::strtoul(argv[3], nullptr, 10) : 20000)
+                   ? 0
+                   : 1;
+    }
+    if (argc > 1 && std::strcmp(argv[1], "handles") == 0) {
+        default_arena_size = 1 << 20;
+        return handle_check(argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 4,
+                            argc > 3 ? std::strtoul(argv[3], nullptr, 10) : 200)
+                   ? 0
+                   : 1;
+    }
+    if (argc > 1 && std::strcmp(argv[1], "api") == 0) {
+        default_arena_size = 1 << 20;
+        return api_check(argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 20000) ? 0 : 1;
+    }
+    if (argc > 1 && std::strcmp(argv[1], "verify") == 0) {
+        default_arena_size = 1 << 20;
+        return verify(argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 1000000) ? 1 : 0;
+    }
+
+    default_arena_size = 4096;
 
     void* p0 = mem_alloc(2000);
     mem_show();